@@ -3,6 +3,12 @@
 layout (location = 0) in vec3 in_position;
 layout (location = 1) in vec3 in_normal;
 layout (location = 2) in vec3 in_color;
+// per instance, defaults of (0, 0, 0, 1) giving identity when not instanced
+layout (location = 3) in vec4 in_offset_scale;
+layout (location = 4) in vec4 in_rotation;
+// per draw, dequantization of packed vertices
+layout (location = 5) in vec3 in_position_offset;
+layout (location = 6) in vec3 in_position_scale;
 
 out vec3 vso_position;
 out vec3 vso_color;
@@ -10,8 +16,14 @@ out vec3 vso_color;
 uniform mat4 model_view;
 uniform mat4 projection;
 
+vec3 rotate(vec4 quaternion, vec3 v) {
+    return v + 2.0f * cross(quaternion.xyz, cross(quaternion.xyz, v) + quaternion.w * v);
+}
+
 void main() {
-    vec4 tmp_position = model_view * vec4(in_position, 1.0f);
+    vec3 position = in_position * in_position_scale + in_position_offset;
+    position = rotate(in_rotation, position) * in_offset_scale.w + in_offset_scale.xyz;
+    vec4 tmp_position = model_view * vec4(position, 1.0f);
     gl_Position = projection * tmp_position;
     vso_position = vec3(tmp_position);
     vso_color = in_color;
@@ -1,8 +1,16 @@
 #version 330 core
 
 layout (location = 0) in vec3 in_position;
+// octahedral encoding in x and y when packed
 layout (location = 1) in vec3 in_normal;
 layout (location = 2) in vec3 in_color;
+// per instance, defaults of (0, 0, 0, 1) giving identity when not instanced
+layout (location = 3) in vec4 in_offset_scale;
+layout (location = 4) in vec4 in_rotation;
+// per draw, dequantization of packed vertices
+layout (location = 5) in vec3 in_position_offset;
+layout (location = 6) in vec3 in_position_scale;
+layout (location = 7) in float in_is_packed;
 
 out vec3 vso_position;
 out vec3 vso_normal;
@@ -12,10 +20,26 @@ uniform mat4 model_view;
 uniform mat3 normal_model_view;
 uniform mat4 projection;
 
+vec3 rotate(vec4 quaternion, vec3 v) {
+    return v + 2.0f * cross(quaternion.xyz, cross(quaternion.xyz, v) + quaternion.w * v);
+}
+
+vec3 decode_octahedral(vec2 encoded) {
+    vec3 normal = vec3(encoded, 1.0f - abs(encoded.x) - abs(encoded.y));
+    if (normal.z < 0.0f) {
+        vec2 signs = vec2(normal.x >= 0.0f ? 1.0f : -1.0f, normal.y >= 0.0f ? 1.0f : -1.0f);
+        normal.xy = (1.0f - abs(normal.yx)) * signs;
+    }
+    return normalize(normal);
+}
+
 void main() {
-    vec4 model_view_position = model_view * vec4(in_position, 1.0f);
+    vec3 position = in_position * in_position_scale + in_position_offset;
+    position = rotate(in_rotation, position) * in_offset_scale.w + in_offset_scale.xyz;
+    vec4 model_view_position = model_view * vec4(position, 1.0f);
     gl_Position = projection * model_view_position;
     vso_position = vec3(model_view_position);
-    vso_normal = normal_model_view * in_normal;
+    vec3 normal = in_is_packed > 0.5f ? decode_octahedral(in_normal.xy) : in_normal;
+    vso_normal = normal_model_view * rotate(in_rotation, normal);
     vso_color = in_color;
 }
@@ -1,158 +1,287 @@
 #include "branch.hpp"
+#include "parallel.hpp"
+#include "turtle.hpp"
+#include "turtle_batch.hpp"
+#include <algorithm>
 #include <cassert>
-#include <stdexcept>
-#include <string>
+#include <cstdint>
+#include <functional>
+#include <limits>
 
 namespace lindenmaker {
 
-using std::string;
+using std::size_t;
 using std::string_view;
 using std::vector;
 
-const auto DIRECTION = glm::vec3{ 0.0f, 1.0f, 0.0f };
+Branch sentence_to_tree(string_view sentence, float angle, float step_length, float radius, float length_decay, float radius_decay, const PruningCriteria& pruning)
+{
+    auto interpreter = TurtleInterpreter{ sentence, angle, step_length, radius, length_decay, radius_decay, pruning };
+    return interpreter.run();
+}
 
-struct Turtle
+Branch sentence_to_tree_parallel(string_view sentence, float angle, float step_length, float radius, float length_decay, float radius_decay, unsigned int threads_count, const PruningCriteria& pruning)
 {
-    glm::vec3 position = glm::vec3{ 0.0f };
-    glm::quat orientation = glm::quat{ 1.0f, 0.0f, 0.0f, 0.0f };
-
-    float angle;
-    float step_length;
-    float radius;
-    float length_decay;
-    float radius_decay;
-
-    Turtle(float angle, float step_length, float radius, float length_decay, float radius_decay)
-        : angle(angle),
-          step_length(step_length),
-          radius(radius),
-          length_decay(length_decay),
-          radius_decay(radius_decay)
-    {
-    }
+    auto interpreter = TurtleInterpreter{ sentence, angle, step_length, radius, length_decay, radius_decay, pruning };
+    return interpreter.run_parallel(threads_count);
+}
 
-    void step_foward()
-    {
-        position += orientation * DIRECTION * step_length;
-    }
+// Symbols between a pair of brackets, which make a single branch
+struct SymbolGroup
+{
+    size_t parent = 0;
+    size_t fork_index = 0;
+    // in scan order, starting with the group marker
+    size_t offset = 0;
+    size_t count = 0;
+    size_t children_count = 0;
+    // scan index of opening bracket in parent group
+    size_t open_index = 0;
+};
 
-    void decay()
-    {
-        step_length *= length_decay;
-        radius *= radius_decay;
-    }
+const auto NO_POSITION = std::numeric_limits<std::uint32_t>::max();
 
-    void plus_yaw()
-    {
-        orientation *= glm::quat(glm::vec3{ 0.0f, 0.0f, angle });
-    }
+/**
+ * Each symbol is mapped to a turtle transform, and transforms are composed with a
+ * segmented prefix scan over symbols reordered by group, so that every group is
+ * a contiguous segment. Absolute states are then obtained by applying these
+ * local prefixes to the state of the turtle at the opening bracket of each group.
+ * Composition order differs from the serial interpreter, so the result is
+ * equivalent but not bit-identical.
+ *
+ * Every step is a scan or a loop over contiguous chunks, so a single trunk is spread
+ * over all threads too. Symbols are reordered by a stable sort on bracket depth: symbols
+ * at a given depth come group after group, each group starting with a marker emitted
+ * right after its opening bracket. Only resolving group turtles goes depth by depth.
+ */
+static Branch scan_the_turtle(const TurtleInterpreter& interpreter, unsigned int threads_count)
+{
+    const auto sentence = interpreter.get_sentence();
+    const auto& symbols = get_symbol_table();
+    auto get_command = [&](size_t i) { return symbols[(unsigned char) sentence[i]].command; };
 
-    void minus_yaw()
-    {
-        orientation *= glm::quat(glm::vec3{ 0.0f, 0.0f, -angle });
-    }
+    // bracket depth after each symbol
+    auto depths = vector<std::int32_t>(sentence.size());
+    parallel_for_chunks(sentence.size(), threads_count, [&](size_t, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            const auto command = get_command(i);
+            depths[i] = command == Command::push ? 1 : (command == Command::pop ? -1 : 0);
+        }
+    });
+    parallel_inclusive_scan(depths, std::plus<std::int32_t>{}, threads_count);
 
-    void plus_roll()
-    {
-        orientation *= glm::quat(glm::vec3{ 0.0f, angle, 0.0f });
-    }
+    // closing bracket at root level ends the tree
+    auto chunk_ends = vector<size_t>(get_chunks_count(sentence.size(), threads_count), sentence.size());
+    parallel_for_chunks(sentence.size(), threads_count, [&](size_t chunk, size_t begin, size_t end) {
+        for (size_t i = begin; i < end; i++) {
+            if (depths[i] < 0) {
+                chunk_ends[chunk] = i;
+                return;
+            }
+        }
+    });
+    const size_t end = chunk_ends.empty() ? 0 : *std::min_element(chunk_ends.begin(), chunk_ends.end());
 
-    void minus_roll()
-    {
-        orientation *= glm::quat(glm::vec3{ 0.0f, -angle, 0.0f });
-    }
+    // root marker, then one element per symbol but closing brackets, opening ones adding their group marker
+    auto stream_offsets = vector<std::uint32_t>(end);
+    parallel_for_chunks(end, threads_count, [&](size_t, size_t begin, size_t chunk_end) {
+        for (size_t i = begin; i < chunk_end; i++) {
+            const auto command = get_command(i);
+            stream_offsets[i] = command == Command::push ? 2 : (command == Command::pop ? 0 : 1);
+        }
+    });
+    parallel_inclusive_scan(stream_offsets, std::plus<std::uint32_t>{}, threads_count);
 
-    void plus_pitch()
-    {
-        orientation *= glm::quat(glm::vec3{ angle, 0.0f, 0.0f });
-    }
+    const size_t scan_size = 1 + (end > 0 ? stream_offsets.back() : 0);
+    auto levels = vector<std::uint32_t>(scan_size, 0);
+    auto positions = vector<std::uint32_t>(scan_size, NO_POSITION);
+    auto is_marker = vector<unsigned char>(scan_size, 0);
+    is_marker[0] = 1;
+    parallel_for_chunks(end, threads_count, [&](size_t, size_t begin, size_t chunk_end) {
+        for (size_t i = begin; i < chunk_end; i++) {
+            const auto command = get_command(i);
+            if (command == Command::pop) {
+                continue;
+            }
+            const auto depth = depths[i] - (command == Command::push ? 1 : 0);
+            const size_t element = 1 + stream_offsets[i] - (command == Command::push ? 2 : 1);
+            levels[element] = depth;
+            positions[element] = i;
+            if (command == Command::push) {
+                levels[element + 1] = depth + 1;
+                positions[element + 1] = i;
+                is_marker[element + 1] = 1;
+            }
+        }
+    });
+    depths = {};
+    stream_offsets = {};
 
-    void minus_pitch()
-    {
-        orientation *= glm::quat(glm::vec3{ -angle, 0.0f, 0.0f });
-    }
-};
+    const auto order = parallel_stable_sort_indices(levels, threads_count);
 
-Branch do_the_turtle(string_view& sentence, Turtle turtle)
-{
-    Branch branch;
-
-    // push starting point
-    branch.points.push_back(turtle.position);
-    branch.radius_begin = turtle.radius;
-
-    while (sentence.size() > 0) {
-        const char symbol = sentence.front();
-        // std::cout << symbol << std::endl;
-        sentence.remove_prefix(1);
-
-        // forward alpha char
-        if (symbol >= 'A' && symbol <= 'Z') {
-            turtle.step_foward();
-            turtle.decay();
-            continue;
+    // local prefix transforms, and running counts of groups and opening brackets
+    auto transforms = vector<TurtleTransform>(scan_size);
+    auto heads = vector<unsigned char>(scan_size);
+    auto group_counts = vector<std::uint32_t>(scan_size);
+    auto push_counts = vector<std::uint32_t>(scan_size);
+    // scan index of each opening bracket in its parent group, by sentence position
+    auto open_indices = vector<std::uint32_t>(end);
+    parallel_for_chunks(scan_size, threads_count, [&](size_t, size_t begin, size_t chunk_end) {
+        for (size_t k = begin; k < chunk_end; k++) {
+            const auto element = order[k];
+            heads[k] = is_marker[element];
+            group_counts[k] = is_marker[element];
+            const bool is_push = !is_marker[element] && get_command(positions[element]) == Command::push;
+            push_counts[k] = is_push;
+            if (is_push) {
+                open_indices[positions[element]] = k;
+            }
+            if (!is_marker[element]) {
+                transforms[k] = interpreter.get_transform(sentence[positions[element]]);
+            }
         }
+    });
+    parallel_segmented_inclusive_scan(transforms, heads, compose, threads_count);
+    parallel_inclusive_scan(group_counts, std::plus<std::uint32_t>{}, threads_count);
+    parallel_inclusive_scan(push_counts, std::plus<std::uint32_t>{}, threads_count);
 
-        // stack char
-        if (symbol == '[') {
-            auto branch_turtle = turtle;
-            branch.forks.push_back(do_the_turtle(sentence, branch_turtle));
-            continue;
-        }
-        if (symbol == ']') {
-            break;
+    // groups are ordered by depth, parents first
+    const size_t groups_count = group_counts.back();
+    auto groups = vector<SymbolGroup>(groups_count);
+    auto group_levels = vector<std::uint32_t>(groups_count);
+    parallel_for_chunks(scan_size, threads_count, [&](size_t, size_t begin, size_t chunk_end) {
+        for (size_t k = begin; k < chunk_end; k++) {
+            if (heads[k]) {
+                groups[group_counts[k] - 1].offset = k;
+                group_levels[group_counts[k] - 1] = levels[order[k]];
+            }
         }
+    });
 
-        // rotation char, push current point
-        if (turtle.position != branch.points.back()) {
-            branch.points.push_back(turtle.position);
+    const size_t levels_count = group_levels.back() + 1;
+    auto level_begins = vector<size_t>(levels_count + 1, groups_count);
+    parallel_for_chunks(groups_count, threads_count, [&](size_t, size_t begin, size_t chunk_end) {
+        for (size_t g = begin; g < chunk_end; g++) {
+            auto& group = groups[g];
+            group.count = (g + 1 < groups_count ? groups[g + 1].offset : scan_size) - group.offset;
+            group.children_count = push_counts[group.offset + group.count - 1] - push_counts[group.offset];
+            if (g == 0 || group_levels[g] != group_levels[g - 1]) {
+                level_begins[group_levels[g]] = g;
+            }
+            if (g == 0) {
+                continue;
+            }
+            group.open_index = open_indices[positions[order[group.offset]]];
+            group.parent = group_counts[group.open_index] - 1;
+            group.fork_index = push_counts[group.open_index] - 1 - push_counts[groups[group.parent].offset];
         }
+    });
 
-        // yaw
-        if (symbol == '+') {
-            turtle.plus_yaw();
-            continue;
-        }
-        if (symbol == '-') {
-            turtle.minus_yaw();
-            continue;
+    // turtle at opening bracket of each group, a depth at a time
+    auto turtles = vector<Turtle>(groups_count, interpreter.get_turtle());
+    for (size_t level = 1; level < levels_count; level++) {
+        const auto begin = level_begins[level];
+        parallel_for_chunks(level_begins[level + 1] - begin, threads_count, [&](size_t, size_t chunk_begin, size_t chunk_end) {
+            for (size_t g = begin + chunk_begin; g < begin + chunk_end; g++) {
+                turtles[g] = turtles[groups[g].parent];
+                turtles[g].apply(transforms[groups[g].open_index]);
+            }
+        });
+    }
+
+    // read off branch points: group starts and turtle positions at rotations
+    auto points = vector<glm::vec3>(scan_size);
+    auto last_points = vector<std::uint32_t>(scan_size, 0);
+    parallel_for_chunks(scan_size, threads_count, [&](size_t, size_t begin, size_t chunk_end) {
+        for (size_t k = begin; k < chunk_end; k++) {
+            if (!heads[k] && get_command(positions[order[k]]) != Command::rotate) {
+                continue;
+            }
+            const auto& turtle = turtles[group_counts[k] - 1];
+            points[k] = turtle.position + turtle.orientation * transforms[k].translation * turtle.step_length;
+            last_points[k] = k;
         }
+    });
+    parallel_inclusive_scan(last_points, [](std::uint32_t a, std::uint32_t b) { return std::max(a, b); }, threads_count);
 
-        // roll
-        if (symbol == '/') {
-            turtle.plus_roll();
-            continue;
+    // consecutive duplicates are dropped, group starts are always kept
+    auto kept_counts = vector<std::uint32_t>(scan_size);
+    parallel_for_chunks(scan_size, threads_count, [&](size_t, size_t begin, size_t chunk_end) {
+        for (size_t k = begin; k < chunk_end; k++) {
+            kept_counts[k] = heads[k] || (last_points[k] == k && points[k] != points[last_points[k - 1]]);
         }
-        if (symbol == '\\') {
-            turtle.minus_roll();
-            continue;
+    });
+    parallel_inclusive_scan(kept_counts, std::plus<std::uint32_t>{}, threads_count);
+
+    auto branches = vector<Branch>(groups_count);
+    parallel_for_chunks(groups_count, threads_count, [&](size_t, size_t begin, size_t chunk_end) {
+        for (size_t g = begin; g < chunk_end; g++) {
+            const auto& group = groups[g];
+            auto& branch = branches[g];
+            branch.forks.resize(group.children_count);
+            branch.radius_begin = turtles[g].radius;
+            // room for the last point
+            const size_t points_count = kept_counts[group.offset + group.count - 1] - kept_counts[group.offset] + 1;
+            branch.points.reserve(points_count + 1);
+            branch.points.resize(points_count);
         }
+    });
 
-        // pitch
-        if (symbol == '^') {
-            turtle.plus_pitch();
-            continue;
+    parallel_for_chunks(scan_size, threads_count, [&](size_t, size_t begin, size_t chunk_end) {
+        for (size_t k = begin; k < chunk_end; k++) {
+            const auto is_kept = k == 0 ? kept_counts[k] : kept_counts[k] - kept_counts[k - 1];
+            if (is_kept) {
+                const auto g = group_counts[k] - 1;
+                branches[g].points[kept_counts[k] - kept_counts[groups[g].offset]] = points[k];
+            }
         }
-        if (symbol == '_') {
-            turtle.minus_pitch();
-            continue;
+    });
+
+    parallel_for_chunks(groups_count, threads_count, [&](size_t, size_t begin, size_t chunk_end) {
+        for (size_t g = begin; g < chunk_end; g++) {
+            const auto& group = groups[g];
+            auto& branch = branches[g];
+            auto last_turtle = turtles[g];
+            last_turtle.apply(transforms[group.offset + group.count - 1]);
+            if (last_turtle.position != branch.points.back()) {
+                branch.points.push_back(last_turtle.position);
+                branch.radius_end = last_turtle.radius;
+            }
         }
+    });
 
-        throw std::runtime_error(string{ "Unknown symbol: " } + symbol);
+    // stitch deepest first so that children are complete when moved
+    for (size_t level = levels_count - 1; level > 0; level--) {
+        const auto begin = level_begins[level];
+        parallel_for_chunks(level_begins[level + 1] - begin, threads_count, [&](size_t, size_t chunk_begin, size_t chunk_end) {
+            for (size_t g = begin + chunk_begin; g < begin + chunk_end; g++) {
+                branches[groups[g].parent].forks[groups[g].fork_index] = std::move(branches[g]);
+            }
+        });
     }
 
-    if (turtle.position != branch.points.back()) {
-        branch.points.push_back(turtle.position);
-        branch.radius_end = turtle.radius;
-    }
+    return std::move(branches[0]);
+}
 
-    // assert(branch.points.size() > 1);
-    return branch;
+Branch sentence_to_tree_scan(string_view sentence, float angle, float step_length, float radius, float length_decay, float radius_decay, unsigned int threads_count)
+{
+    auto interpreter = TurtleInterpreter{ sentence, angle, step_length, radius, length_decay, radius_decay };
+    return scan_the_turtle(interpreter, threads_count);
 }
 
-Branch sentence_to_tree(std::string_view sentence, float angle, float step_length, float radius, float length_decay, float radius_decay)
+vector<Branch> sentence_to_trees(string_view sentence, const vector<TurtleParameters>& variants)
 {
-    auto turtle = Turtle{ angle, step_length, radius, length_decay, radius_decay };
-    return do_the_turtle(sentence, turtle);
+    auto trees = vector<Branch>{};
+    trees.reserve(variants.size());
+
+    for (size_t i = 0; i < variants.size(); i += LANES_COUNT) {
+        const auto variants_count = std::min(LANES_COUNT, variants.size() - i);
+        auto interpreter = BatchTurtleInterpreter{ sentence, variants.data() + i, variants_count };
+        for (auto& tree : interpreter.run()) {
+            trees.push_back(std::move(tree));
+        }
+    }
+
+    return trees;
 }
 }
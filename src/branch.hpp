@@ -1,5 +1,6 @@
 #pragma once
 #include <glm/glm.hpp>
+#include <functional>
 #include <glm/gtc/quaternion.hpp>
 #include <string_view>
 #include <vector>
@@ -12,7 +13,40 @@ struct Branch
     std::vector<Branch> forks;
     float radius_begin;
     float radius_end;
+    // leaf marker for a subtree that was pruned, with a single point
+    bool is_pruned = false;
 };
 
-Branch sentence_to_tree(std::string_view sentence, float angle, float step_length, float radius, float length_decay, float radius_decay);
+struct TurtleParameters
+{
+    float angle;
+    float step_length;
+    float radius;
+    float length_decay;
+    float radius_decay;
+};
+
+/**
+ * Subtrees starting with a turtle below these are collapsed to a leaf marker and skipped.
+ * Only checked at opening brackets, so decays are assumed to be <= 1.
+ */
+struct PruningCriteria
+{
+    float min_radius = 0.0f;
+    float min_step_length = 0.0f;
+    // optional, e.g. to compare projected size to pixels, returns true to prune
+    // may be called from several threads at once
+    std::function<bool(const glm::vec3& position, float step_length, float radius)> should_prune;
+};
+
+Branch sentence_to_tree(std::string_view sentence, float angle, float step_length, float radius, float length_decay, float radius_decay, const PruningCriteria& pruning = {});
+
+/** Bit-identical to sentence_to_tree(), interpreting big subtrees on several threads */
+Branch sentence_to_tree_parallel(std::string_view sentence, float angle, float step_length, float radius, float length_decay, float radius_decay, unsigned int threads_count, const PruningCriteria& pruning = {});
+
+/** Data-parallel interpretation with a prefix scan of turtle transforms, equivalent to sentence_to_tree() up to rounding */
+Branch sentence_to_tree_scan(std::string_view sentence, float angle, float step_length, float radius, float length_decay, float radius_decay, unsigned int threads_count);
+
+/** One tree per parameter set, walking the sentence once for several sets at a time */
+std::vector<Branch> sentence_to_trees(std::string_view sentence, const std::vector<TurtleParameters>& variants);
 }
@@ -1,56 +1,212 @@
 #include "curve.hpp"
+#include "lanes.hpp"
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <glm/gtc/matrix_transform.hpp>
 
 namespace lindenmaker {
 
-using std::tuple;
+using std::size_t;
 using std::vector;
 
 const float EPSILON = 0.001f;
+// dense samples per adaptive segment, or per cubic segment of the curve if fewer, for curvature estimation
+const unsigned int OVERSAMPLING = 4;
+const unsigned int SAMPLES_PER_CUBIC_SEGMENT = 4;
 
 // Abstract curve
 
-// cf https://stackoverflow.com/a/33419880
-tuple<glm::vec3, glm::vec3, glm::vec3> Curve::get_tbn(const float x) const
+void Curve::get_points(const float* xs, size_t count, glm::vec3* points, glm::vec3* derivatives) const
 {
-    float x1 = std::max(x - EPSILON, 0.0f);
-    float x2 = std::min(x + EPSILON, 1.0f);
+    for (size_t i = 0; i < count; i++) {
+        if (points != nullptr) {
+            points[i] = get_point(xs[i]);
+        }
+        if (derivatives != nullptr) {
+            derivatives[i] = get_derivative(xs[i]);
+        }
+    }
+}
 
-    auto point_1 = get_point(x1);
-    auto point_2 = get_point(x2);
+/**
+ * An arc of length l turning by angle a is approximated by its chord within l * a / 8,
+ * so evenly spreading the error over segments means spreading the integral of sqrt(l * a)
+ * along the curve, which is tabulated from dense samples.
+ */
+vector<float> get_adaptive_samples(const Curve& curve, float max_error, unsigned int max_segments_count)
+{
+    assert(max_error > 0.0f && max_segments_count > 0);
 
-    auto tangent = point_2 - point_1;
-    assert(glm::length(tangent) != 0.0f);
-    // DO NOT NORMALIZE TANGENT !!
-
-    auto binormal = glm::cross(tangent, point_2 + point_1);
-    if (glm::length(binormal) != 0.0f) {
-        // abs: avoid brutal direction change when sign changes
-        // TODO not working
-        binormal = glm::normalize(glm::abs(binormal));
-        //binormal = glm::normalize(binormal);
-    } else {
-        // avoid nan by choosing arbitrary binormal
-        // TODO is this troublesome?
-        if (tangent.x != 0.0) {
-            binormal.y = 1.0;
-        } else if (tangent.y != 0.0) {
-            binormal.z = 1.0;
+    auto dense_count = max_segments_count * OVERSAMPLING;
+    if (curve.get_segments_count() > 0) {
+        dense_count = (unsigned int) std::min<size_t>(dense_count, curve.get_segments_count() * SAMPLES_PER_CUBIC_SEGMENT);
+    }
+    auto dense_xs = vector<float>(dense_count + 1);
+    for (unsigned int i = 0; i <= dense_count; i++) {
+        dense_xs[i] = (float) i / (float) dense_count;
+    }
+    auto points = vector<glm::vec3>(dense_xs.size());
+    auto derivatives = vector<glm::vec3>(dense_xs.size());
+    curve.get_points(dense_xs.data(), dense_xs.size(), points.data(), derivatives.data());
+
+    // cumulative segments needed up to each dense sample
+    auto needs = vector<float>(dense_xs.size());
+    auto tangent = glm::vec3{ 0.0f };
+    for (unsigned int i = 0; i <= dense_count; i++) {
+        // keep previous tangent where the curve stops
+        const auto next_tangent = glm::length(derivatives[i]) != 0.0f ? glm::normalize(derivatives[i]) : tangent;
+        if (i > 0) {
+            const float length = glm::length(points[i] - points[i - 1]);
+            const float angle = std::acos(glm::clamp(glm::dot(tangent, next_tangent), -1.0f, 1.0f));
+            needs[i] = needs[i - 1] + std::sqrt(length * angle / (8.0f * max_error));
+        }
+        tangent = next_tangent;
+    }
+
+    const auto segments_count = glm::clamp((unsigned int) std::ceil(needs.back()), 1u, max_segments_count);
+    auto xs = vector<float>{ 0.0f };
+    xs.reserve(segments_count + 1);
+
+    // invert the table
+    unsigned int dense_index = 1;
+    for (unsigned int i = 1; i < segments_count; i++) {
+        const float need = needs.back() * (float) i / (float) segments_count;
+        while (needs[dense_index] < need) {
+            dense_index++;
+        }
+        const float weight = (need - needs[dense_index - 1]) / (needs[dense_index] - needs[dense_index - 1]);
+        xs.push_back(glm::mix(dense_xs[dense_index - 1], dense_xs[dense_index], weight));
+    }
+
+    xs.push_back(1.0f);
+    return xs;
+}
+
+// cf. Reumann-Witkam: runs of points are dropped while they stay close to the line from their anchor
+// towards the first point of the run, the last point of a run then becoming the next anchor
+size_t simplify_points(glm::vec3* points, size_t points_count, float min_distance, float max_deviation)
+{
+    if (points_count <= 2) {
+        return points_count;
+    }
+
+    size_t kept_count = 1;
+    // last point of current run, 0 if none
+    size_t run_end = 0;
+    auto direction = glm::vec3{ 0.0f };
+
+    for (size_t i = 1; i < points_count; i++) {
+        const auto anchor = points[kept_count - 1];
+        const auto point = points[i];
+        if (glm::distance(anchor, point) < min_distance) {
+            continue;
+        }
+
+        if (run_end == 0) {
+            direction = glm::normalize(point - anchor);
         } else {
-            assert(tangent.z != 0.0);
-            binormal.x = 1.0;
+            const auto offset = point - anchor;
+            if (glm::length(offset - direction * glm::dot(offset, direction)) >= max_deviation) {
+                points[kept_count++] = points[run_end];
+                direction = glm::normalize(point - points[run_end]);
+            }
+        }
+        run_end = i;
+    }
+
+    // last point is always kept, replacing previous one if too close
+    const auto last = points[points_count - 1];
+    if (run_end != points_count - 1) {
+        if (run_end != 0) {
+            points[kept_count++] = points[run_end];
+        }
+        if (kept_count > 1 && glm::distance(points[kept_count - 1], last) < min_distance) {
+            kept_count--;
         }
     }
+    points[kept_count++] = last;
 
-    auto normal = glm::cross(binormal, tangent);
-    assert(glm::length(normal) != 0.0f);
-    // abs: avoid brutal direction change when sign changes
-    // TODO not working
-    //normal = glm::normalize(glm::abs(normal));
-    normal = glm::normalize(normal);
-    return { tangent, binormal, normal };
+    return kept_count;
+}
+
+// Lanes helpers, samples are processed LANES_COUNT at a time
+// and unused lanes of the last batch repeat the last sample
+
+static Lanes load_lanes(const float* values, size_t count)
+{
+    auto lanes = Lanes{};
+    for (size_t lane = 0; lane < LANES_COUNT; lane++) {
+        lanes[lane] = values[std::min(lane, count - 1)];
+    }
+    return lanes;
+}
+
+static void store_lanes(const LaneVector& lanes, glm::vec3* values, size_t count)
+{
+    for (size_t lane = 0; lane < count; lane++) {
+        values[lane] = get_lane(lanes, lane);
+    }
+}
+
+// a * x + b
+static LaneVector multiply_add(const LaneVector& a, const Lanes& x, const LaneVector& b)
+{
+    return { a.x * x + b.x, a.y * x + b.y, a.z * x + b.z };
+}
+
+static LaneVector multiply(const LaneVector& a, const Lanes& x)
+{
+    return { a.x * x, a.y * x, a.z * x };
+}
+
+// Frames
+
+Frame make_frame(const glm::vec3& tangent)
+{
+    assert(glm::length(tangent) != 0.0f);
+    const auto unit_tangent = glm::normalize(tangent);
+
+    // axis least aligned with tangent
+    const auto abs_tangent = glm::abs(unit_tangent);
+    auto axis = glm::vec3{ 0.0f };
+    if (abs_tangent.x <= abs_tangent.y && abs_tangent.x <= abs_tangent.z) {
+        axis.x = 1.0f;
+    } else if (abs_tangent.y <= abs_tangent.z) {
+        axis.y = 1.0f;
+    } else {
+        axis.z = 1.0f;
+    }
+
+    const auto normal = glm::normalize(glm::cross(unit_tangent, axis));
+    return { unit_tangent, normal, glm::cross(unit_tangent, normal) };
+}
+
+Frame transport_frame(const Frame& frame, const glm::vec3& point, const glm::vec3& next_point, const glm::vec3& next_tangent)
+{
+    // keep previous tangent where the curve stops
+    const auto tangent = glm::length(next_tangent) != 0.0f ? glm::normalize(next_tangent) : frame.tangent;
+    auto normal = frame.normal;
+
+    // reflect across the plane bisecting both points
+    const auto delta = next_point - point;
+    const float delta_square = glm::dot(delta, delta);
+    auto reflected_tangent = frame.tangent;
+    if (delta_square != 0.0f) {
+        normal -= (2.0f / delta_square) * glm::dot(delta, normal) * delta;
+        reflected_tangent -= (2.0f / delta_square) * glm::dot(delta, reflected_tangent) * delta;
+    }
+
+    // reflect again so that reflected tangent matches next tangent
+    const auto tangent_delta = tangent - reflected_tangent;
+    const float tangent_delta_square = glm::dot(tangent_delta, tangent_delta);
+    if (tangent_delta_square != 0.0f) {
+        normal -= (2.0f / tangent_delta_square) * glm::dot(tangent_delta, normal) * tangent_delta;
+    }
+
+    // fight drift
+    normal = glm::normalize(normal - glm::dot(normal, tangent) * tangent);
+    return { tangent, normal, glm::cross(tangent, normal) };
 }
 
 // Circle curve
@@ -63,15 +219,36 @@ glm::vec3 CircleCurve::get_point(const float x) const
     return glm::vec3{ radius_ * std::cos(angle), radius_ * std::sin(angle), 0.0f };
 }
 
-// CatmullRomCurve
+glm::vec3 CircleCurve::get_derivative(const float x) const
+{
+    float angle = 2.0f * M_PI * x;
+    float factor = 2.0f * M_PI * radius_;
+    return glm::vec3{ -factor * std::sin(angle), factor * std::cos(angle), 0.0f };
+}
 
-CatmullRomCurve::CatmullRomCurve(const vector<glm::vec3>& points) : points_(points)
+void CircleCurve::get_points(const float* xs, size_t count, glm::vec3* points, glm::vec3* derivatives) const
 {
-    assert(points_.size() > 1);
+    const float factor = 2.0f * M_PI * radius_;
+
+    for (size_t begin = 0; begin < count; begin += LANES_COUNT) {
+        const size_t lanes_count = std::min(LANES_COUNT, count - begin);
+        const auto angles = load_lanes(xs + begin, lanes_count) * (float) (2.0 * M_PI);
+        Lanes sines, cosines;
+        sincos(angles, sines, cosines);
+
+        if (points != nullptr) {
+            store_lanes({ radius_ * cosines, radius_ * sines, Lanes{} }, points + begin, lanes_count);
+        }
+        if (derivatives != nullptr) {
+            store_lanes({ -factor * sines, factor * cosines, Lanes{} }, derivatives + begin, lanes_count);
+        }
+    }
 }
 
+// Cubic curves
+
 // https://stackoverflow.com/a/23980479
-glm::vec3 centripedal_catmull_rom(float x, const glm::vec3& point_0, const glm::vec3& point_1, const glm::vec3& point_2, const glm::vec3& point_3)
+CubicSegment make_centripedal_catmull_rom(const glm::vec3& point_0, const glm::vec3& point_1, const glm::vec3& point_2, const glm::vec3& point_3)
 {
     // 0.25 => 0.5 * 0.5 (centripetal)
     float delta_0 = std::pow(glm::length(point_1 - point_0), 0.25f);
@@ -99,60 +276,150 @@ glm::vec3 centripedal_catmull_rom(float x, const glm::vec3& point_0, const glm::
     tangeant_1 *= delta_1;
     tangeant_2 *= delta_1;
 
-    const auto coef_0 = point_1;
-    const auto coef_1 = tangeant_1;
-    const auto coef_2 = -3.0f * point_1 + 3.0f * point_2 - 2.0f * tangeant_1 - tangeant_2;
-    const auto coef_3 = 2.0f * point_1 - 2.0f * point_2 + tangeant_1 + tangeant_2;
+    return { {
+        point_1,
+        tangeant_1,
+        -3.0f * point_1 + 3.0f * point_2 - 2.0f * tangeant_1 - tangeant_2,
+        2.0f * point_1 - 2.0f * point_2 + tangeant_1 + tangeant_2 //
+    } };
+}
 
-    const float x_square = x * x;
-    const float x_cube = x_square * x;
+CubicSegment make_uniform_b_spline(const glm::vec3& point_0, const glm::vec3& point_1, const glm::vec3& point_2, const glm::vec3& point_3)
+{
+    // constant basis matrix
+    return { {
+        (point_0 + 4.0f * point_1 + point_2) / 6.0f,
+        (point_2 - point_0) / 2.0f,
+        (point_0 - 2.0f * point_1 + point_2) / 2.0f,
+        (point_3 - point_0 + 3.0f * (point_1 - point_2)) / 6.0f //
+    } };
+}
 
-    return coef_0 + coef_1 * x + coef_2 * x_square + coef_3 * x_cube;
+// extrapolate points before first and after last, then build one segment per pair of consecutive points
+// cf. https://github.com/mrdoob/three.js/blob/master/src/extras/curves/CatmullRomCurve3.js
+template <typename F>
+static vector<CubicSegment> make_segments(const glm::vec3* points, size_t points_count, F make_segment)
+{
+    assert(points_count > 1);
+    auto segments = vector<CubicSegment>{};
+    segments.reserve(points_count - 1);
+
+    const auto before_first = points[0] - (points[1] - points[0]);
+    const auto after_last = points[points_count - 1] + (points[points_count - 1] - points[points_count - 2]);
+
+    for (size_t i = 0; i < points_count - 1; i++) {
+        const auto& point_0 = i > 0 ? points[i - 1] : before_first;
+        const auto& point_3 = i + 2 < points_count ? points[i + 2] : after_last;
+        segments.push_back(make_segment(point_0, points[i], points[i + 1], point_3));
+    }
+
+    return segments;
+}
+
+CatmullRomCurve::CatmullRomCurve(const glm::vec3* points, size_t points_count)
+    : SegmentedCurve(make_segments(points, points_count, make_centripedal_catmull_rom))
+{
+}
+
+// with points reflected at both ends, the spline reaches the first and last points
+BSplineCurve::BSplineCurve(const glm::vec3* points, size_t points_count)
+    : SegmentedCurve(make_segments(points, points_count, make_uniform_b_spline))
+{
+}
+
+static CubicSegment make_line(const glm::vec3&, const glm::vec3& point_1, const glm::vec3& point_2, const glm::vec3&)
+{
+    return { { point_1, point_2 - point_1, glm::vec3{ 0.0f }, glm::vec3{ 0.0f } } };
 }
 
-glm::vec3 CatmullRomCurve::get_point(float x) const
+PolylineCurve::PolylineCurve(const glm::vec3* points, size_t points_count)
+    : SegmentedCurve(make_segments(points, points_count, make_line))
+{
+}
+
+std::shared_ptr<Curve> make_curve(CurveKernel kernel, const glm::vec3* points, size_t points_count)
+{
+    switch (kernel) {
+    case CurveKernel::b_spline:
+        return std::make_shared<BSplineCurve>(points, points_count);
+    case CurveKernel::polyline:
+        return std::make_shared<PolylineCurve>(points, points_count);
+    default:
+        assert(kernel == CurveKernel::catmull_rom);
+        return std::make_shared<CatmullRomCurve>(points, points_count);
+    }
+}
+
+// SegmentedCurve
+
+SegmentedCurve::SegmentedCurve(vector<CubicSegment> segments) : segments_(std::move(segments))
+{
+    assert(!segments_.empty());
+}
+
+size_t SegmentedCurve::find_segment(float x, float& weight) const
 {
     assert(x >= 0.0f && x <= 1.0f);
-    // x = std::max(x, 0.0f);
-    // x = std::min(x, 1.0f);
 
-    float float_index = (float) (points_.size() - 1) * x;
-    unsigned int index_1 = std::floor(float_index);
-    unsigned int index_2 = std::ceil(float_index);
+    float float_index = (float) segments_.size() * x;
+    size_t index = std::floor(float_index);
+    weight = float_index - (float) index;
 
-    // why ?
-    float weight = (float_index - (float) index_1);
-    if (weight == 0.0f && index_1 == points_.size() - 1) {
-        index_1 = points_.size() - 2;
+    // end of last segment
+    if (index == segments_.size()) {
+        index = segments_.size() - 1;
         weight = 1.0f;
     }
 
-    const auto point_1 = points_[index_1];
-    const auto point_2 = points_[index_2];
+    return index;
+}
 
-    glm::vec3 point_0, point_3;
-    if (index_1 > 0) {
-        point_0 = points_[index_1 - 1];
-    } else {
-        // extrapolate point before first
-        // cf. https://github.com/mrdoob/three.js/blob/master/src/extras/curves/CatmullRomCurve3.js
-        const auto first = points_[0];
-        const auto second = points_[1];
-        const auto slope = second - first;
-        point_0 = first - slope;
-    }
+glm::vec3 SegmentedCurve::get_point(float x) const
+{
+    float weight;
+    const auto index = find_segment(x, weight);
+    return segments_[index].get_point(weight);
+}
 
-    if (index_2 < points_.size() - 1) {
-        point_3 = points_[index_2 + 1];
-    } else {
-        // extrapolate point after last
-        // cf. https://github.com/mrdoob/three.js/blob/master/src/extras/curves/CatmullRomCurve3.js
-        const auto last = points_.back();
-        const auto last_but_one = points_.end()[-2];
-        const auto slope = last - last_but_one;
-        point_3 = last + slope;
-    }
+glm::vec3 SegmentedCurve::get_derivative(float x) const
+{
+    float weight;
+    const auto index = find_segment(x, weight);
+    // segments are evenly spread over [0, 1]
+    return segments_[index].get_derivative(weight) * (float) segments_.size();
+}
+
+void SegmentedCurve::get_points(const float* xs, size_t count, glm::vec3* points, glm::vec3* derivatives) const
+{
+    const auto derivative_scale = broadcast((float) segments_.size());
+
+    for (size_t begin = 0; begin < count; begin += LANES_COUNT) {
+        const size_t lanes_count = std::min(LANES_COUNT, count - begin);
+
+        // gather coefficients of the segment of each sample
+        auto coefs = std::array<LaneVector, 4>{};
+        auto weights = Lanes{};
+        for (size_t lane = 0; lane < LANES_COUNT; lane++) {
+            float weight;
+            const auto& segment = segments_[find_segment(xs[begin + std::min(lane, lanes_count - 1)], weight)];
+            weights[lane] = weight;
+            for (size_t i = 0; i < 4; i++) {
+                set_lane(coefs[i], lane, segment.coefs[i]);
+            }
+        }
 
-    return centripedal_catmull_rom(weight, point_0, point_1, point_2, point_3);
+        // same operations as CubicSegment
+        if (points != nullptr) {
+            auto point = multiply_add(coefs[3], weights, coefs[2]);
+            point = multiply_add(point, weights, coefs[1]);
+            point = multiply_add(point, weights, coefs[0]);
+            store_lanes(point, points + begin, lanes_count);
+        }
+        if (derivatives != nullptr) {
+            auto derivative = multiply_add(coefs[3], weights * 3.0f, multiply(coefs[2], broadcast(2.0f)));
+            derivative = multiply_add(derivative, weights, coefs[1]);
+            store_lanes(multiply(derivative, derivative_scale), derivatives + begin, lanes_count);
+        }
+    }
 }
 }
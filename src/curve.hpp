@@ -1,6 +1,8 @@
 #pragma once
+#include <array>
+#include <cstddef>
 #include <glm/glm.hpp>
-#include <tuple>
+#include <memory>
 #include <vector>
 
 namespace lindenmaker {
@@ -9,26 +11,126 @@ class Curve
 {
 public:
     virtual glm::vec3 get_point(float x) const = 0;
-    virtual std::tuple<glm::vec3, glm::vec3, glm::vec3> get_tbn(float x) const;
+    /** Derivative of get_point() with respect to x */
+    virtual glm::vec3 get_derivative(float x) const = 0;
+    /** Both of the above for count parameters at once, points or derivatives can be null if not needed */
+    virtual void get_points(const float* xs, std::size_t count, glm::vec3* points, glm::vec3* derivatives) const;
+    /** Polynomial pieces the curve is made of, 0 if it isn't piecewise polynomial */
+    virtual std::size_t get_segments_count() const { return 0; }
 };
 
+/**
+ * Parameters, 0 and 1 included, at which to sample curve so that the polyline through samples
+ * deviates from it by about max_error at most, using at most max_segments_count segments.
+ * Curvature is estimated from a few samples per polynomial piece of curve if it has any.
+ */
+std::vector<float> get_adaptive_samples(const Curve& curve, float max_error, unsigned int max_segments_count);
+
+/**
+ * Drops, in a single pass, points closer than min_distance to the previous kept one,
+ * and points within max_deviation of a straight run. First and last points are kept.
+ * Kept points are moved to the front and their count returned.
+ */
+std::size_t simplify_points(glm::vec3* points, std::size_t points_count, float min_distance, float max_deviation);
+
+/** Orthonormal frame along a curve, binormal being cross(tangent, normal) */
+struct Frame
+{
+    glm::vec3 tangent;
+    glm::vec3 normal;
+    glm::vec3 binormal;
+};
+
+/** Arbitrary frame around a non null tangent */
+Frame make_frame(const glm::vec3& tangent);
+
+/**
+ * Frame moved from point to next_point with minimal rotation around the curve, by double reflection
+ * cf. Wang et al. 2008, "Computation of rotation minimizing frames"
+ */
+Frame transport_frame(const Frame& frame, const glm::vec3& point, const glm::vec3& next_point, const glm::vec3& next_tangent);
+
 class CircleCurve : public Curve
 {
 public:
     CircleCurve(float radius = 1.0f);
     glm::vec3 get_point(float x) const final;
+    glm::vec3 get_derivative(float x) const final;
+    void get_points(const float* xs, std::size_t count, glm::vec3* points, glm::vec3* derivatives) const final;
 
 private:
     float radius_;
 };
 
-class CatmullRomCurve : public Curve
+/** Cubic polynomial of a curve segment, for x in [0, 1] */
+struct CubicSegment
+{
+    std::array<glm::vec3, 4> coefs;
+
+    glm::vec3 get_point(float x) const
+    {
+        return coefs[0] + x * (coefs[1] + x * (coefs[2] + x * coefs[3]));
+    }
+
+    glm::vec3 get_derivative(float x) const
+    {
+        return coefs[1] + x * (2.0f * coefs[2] + x * 3.0f * coefs[3]);
+    }
+};
+
+/** Segment between point_1 and point_2 */
+CubicSegment make_centripedal_catmull_rom(const glm::vec3& point_0, const glm::vec3& point_1, const glm::vec3& point_2, const glm::vec3& point_3);
+
+/** Segment of uniform cubic B-spline with given control points, near point_1 and point_2 */
+CubicSegment make_uniform_b_spline(const glm::vec3& point_0, const glm::vec3& point_1, const glm::vec3& point_2, const glm::vec3& point_3);
+
+/** Cubic segments evenly spread over [0, 1], evaluated LANES_COUNT samples at a time */
+class SegmentedCurve : public Curve
 {
 public:
-    CatmullRomCurve(const std::vector<glm::vec3>& points);
+    SegmentedCurve(std::vector<CubicSegment> segments);
     glm::vec3 get_point(float x) const final;
+    glm::vec3 get_derivative(float x) const final;
+    void get_points(const float* xs, std::size_t count, glm::vec3* points, glm::vec3* derivatives) const final;
+    std::size_t get_segments_count() const final { return segments_.size(); }
 
 private:
-    std::vector<glm::vec3> points_;
+    std::vector<CubicSegment> segments_;
+
+    // index of segment containing x, and x within that segment
+    std::size_t find_segment(float x, float& weight) const;
+};
+
+// Points are only read at construction by all curves below
+
+/** Centripetal Catmull-Rom spline through points */
+class CatmullRomCurve : public SegmentedCurve
+{
+public:
+    CatmullRomCurve(const glm::vec3* points, std::size_t points_count);
+    CatmullRomCurve(const std::vector<glm::vec3>& points) : CatmullRomCurve(points.data(), points.size()) {}
+};
+
+/** Uniform cubic B-spline, through first and last points only, cheaper and smoother than Catmull-Rom */
+class BSplineCurve : public SegmentedCurve
+{
+public:
+    BSplineCurve(const glm::vec3* points, std::size_t points_count);
 };
+
+/** Straight segments between points */
+class PolylineCurve : public SegmentedCurve
+{
+public:
+    PolylineCurve(const glm::vec3* points, std::size_t points_count);
+};
+
+enum class CurveKernel
+{
+    catmull_rom,
+    b_spline,
+    polyline
+};
+
+std::shared_ptr<Curve> make_curve(CurveKernel kernel, const glm::vec3* points, std::size_t points_count);
 }
@@ -1,177 +1,305 @@
 #include "geometry.hpp"
+#include "normals.hpp"
+#include "parallel.hpp"
 #include <algorithm>
+#include <array>
 #include <cassert>
 #include <ctgmath>
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtc/type_ptr.hpp>
 
 #include "glad.hpp"
+#include <map>
+#include <mutex>
 #include <numeric>
 
 namespace lindenmaker {
 
-using std::make_shared;
-using std::shared_ptr;
+using std::size_t;
 using std::vector;
 
-const VertexIndex RESTART_INDEX = 65535;
+// restart index of 16 bit index buffers
+const GLushort SHORT_RESTART_INDEX = std::numeric_limits<GLushort>::max();
+
+// shader attribute locations
+const GLuint POSITION_LOCATION = 0;
+const GLuint NORMAL_LOCATION = 1;
+const GLuint COLOR_LOCATION = 2;
+const GLuint INSTANCE_OFFSET_SCALE_LOCATION = 3;
+const GLuint INSTANCE_ROTATION_LOCATION = 4;
+const GLuint POSITION_OFFSET_LOCATION = 5;
+const GLuint POSITION_SCALE_LOCATION = 6;
+const GLuint IS_PACKED_LOCATION = 7;
+
+/** Vertex of VertexLayout::packed */
+struct PackedVertex
+{
+    // normalized within mesh bounds
+    std::array<GLushort, 3> position;
+    // keeps normal 4 bytes aligned
+    GLushort padding;
+    // octahedral encoding, normalized to [-1, 1]
+    std::array<GLshort, 2> normal;
+};
 
 Vertex::Vertex(glm::vec3 position) : position(position) {}
 Vertex::Vertex(glm::vec3 position, glm::vec3 color) : position(position), color(color) {}
 
-Geometry::Geometry(const vector<Vertex>& vertices, const vector<VertexIndex>& indices, Primitive primitive)
-    : vertices_(vertices), indices_(indices), primitive_(primitive)
+Instance::Instance(const glm::vec3& offset, float scale, const glm::quat& rotation)
+    : offset_scale(offset, scale),
+      rotation(rotation.x, rotation.y, rotation.z, rotation.w)
 {
-    compute_faces();
-    compute_vertex_normals();
-    init_gl();
 }
 
-vector<Face> compute_triangle_strip_faces(const vector<VertexIndex>& indices)
+Geometry::Geometry(const MeshData& mesh)
+    : primitive_(mesh.primitive),
+      indices_count_(mesh.indices.size()),
+      bounds_(mesh.bounds),
+      lods_(mesh.lods)
 {
-    auto faces = vector<Face>{};
-    for (auto i = 2; i < indices.size(); i++) {
-        if (indices[i - 2] == RESTART_INDEX) {
-            continue;
-        }
-        if (indices[i - 1] == RESTART_INDEX) {
+    init_gl(mesh);
+}
+
+Bounds compute_bounds(const vector<Vertex>& vertices)
+{
+    auto bounds = Bounds{};
+    for (const auto& vertex : vertices) {
+        bounds.add(vertex.position);
+    }
+    return bounds;
+}
+
+void compute_normals(MeshData& mesh)
+{
+    const auto threads_count = get_default_threads_count();
+    if (mesh.primitive == Primitive::triangles) {
+        compute_vertex_normals(mesh.vertices, mesh.indices, NormalsWeighting::angle, threads_count);
+    } else {
+        compute_vertex_normals(mesh.vertices, to_triangle_list(mesh.indices, mesh.primitive), NormalsWeighting::angle, threads_count);
+    }
+}
+
+static MeshData make_mesh(vector<Vertex> vertices, vector<VertexIndex> indices, Primitive primitive, bool should_compute_normals)
+{
+    auto bounds = compute_bounds(vertices);
+    auto mesh = MeshData{ std::move(vertices), std::move(indices), primitive, bounds, {} };
+    if (should_compute_normals) {
+        compute_normals(mesh);
+    }
+    return mesh;
+}
+
+vector<VertexIndex> to_triangle_list(const vector<VertexIndex>& indices, Primitive primitive)
+{
+    if (primitive == Primitive::triangles) {
+        return indices;
+    }
+
+    auto triangles = vector<VertexIndex>{};
+    if (primitive == Primitive::lines) {
+        return triangles;
+    }
+    assert(primitive == Primitive::triangle_strip || primitive == Primitive::triangle_fan);
+    triangles.reserve(indices.size() * 3);
+
+    // primitives restart after each RESTART_INDEX
+    size_t begin = 0;
+    for (size_t i = 0; i < indices.size(); i++) {
+        if (indices[i] == RESTART_INDEX) {
+            begin = i + 1;
             continue;
         }
-        if (indices[i] == RESTART_INDEX) {
+        if (i < begin + 2) {
             continue;
         }
 
-        faces.push_back({
-            indices[i - 2],
-            indices[i - 1],
-            indices[i] //
-        });
+        if (primitive == Primitive::triangle_fan) {
+            triangles.insert(triangles.end(), { indices[begin], indices[i - 1], indices[i] });
+        } else if ((i - begin) % 2 == 0) {
+            triangles.insert(triangles.end(), { indices[i - 2], indices[i - 1], indices[i] });
+        } else {
+            // every other strip triangle is reversed to keep the same winding
+            triangles.insert(triangles.end(), { indices[i - 1], indices[i - 2], indices[i] });
+        }
     }
-    return faces;
+
+    return triangles;
 }
 
-vector<Face> compute_triangle_fan_faces(const vector<VertexIndex>& indices)
+MeshData merge_meshes(const vector<MeshData>& meshes)
 {
-    auto faces = vector<Face>{};
-    for (unsigned int i = 0; i < indices.size(); i++) {
-        if (indices[i - 1] == RESTART_INDEX) {
-            continue;
+    auto merged = MeshData{};
+    if (meshes.empty()) {
+        return merged;
+    }
+    merged.primitive = meshes.front().primitive;
+    const bool needs_restarts = merged.primitive == Primitive::triangle_strip || merged.primitive == Primitive::triangle_fan;
+
+    // where each mesh goes, so that they can be copied concurrently
+    auto vertex_offsets = vector<size_t>(meshes.size() + 1, 0);
+    auto index_offsets = vector<size_t>(meshes.size() + 1, 0);
+    for (size_t i = 0; i < meshes.size(); i++) {
+        assert(meshes[i].primitive == merged.primitive && meshes[i].lods.empty());
+        vertex_offsets[i + 1] = vertex_offsets[i] + meshes[i].vertices.size();
+        index_offsets[i + 1] = index_offsets[i] + meshes[i].indices.size() + (needs_restarts && i > 0);
+        merged.bounds.add(meshes[i].bounds.min);
+        merged.bounds.add(meshes[i].bounds.max);
+    }
+    assert(vertex_offsets.back() < RESTART_INDEX);
+
+    merged.vertices.resize(vertex_offsets.back());
+    merged.indices.resize(index_offsets.back());
+    parallel_for(meshes.size(), get_default_threads_count(), [&](size_t i) {
+        const auto& mesh = meshes[i];
+        std::copy(mesh.vertices.begin(), mesh.vertices.end(), merged.vertices.begin() + vertex_offsets[i]);
+
+        auto index = merged.indices.begin() + index_offsets[i];
+        if (needs_restarts && i > 0) {
+            *index++ = RESTART_INDEX;
         }
-        assert(indices[0] != RESTART_INDEX);
-        assert(indices[i - 1] != RESTART_INDEX);
-        assert(indices[i] != RESTART_INDEX);
-
-        faces.push_back({
-            indices[0],
-            indices[i - 1],
-            indices[i] //
+        const VertexIndex offset = vertex_offsets[i];
+        std::transform(mesh.indices.begin(), mesh.indices.end(), index, [offset](VertexIndex index) {
+            return index == RESTART_INDEX ? RESTART_INDEX : index + offset;
         });
-    }
-    return faces;
+    });
+
+    return merged;
 }
 
-vector<Face> compute_triangles_faces(const vector<VertexIndex>& indices)
+void Geometry::init_gl(const MeshData& mesh)
 {
-    auto faces = vector<Face>{};
-    for (unsigned int i = 0; i < indices.size(); i += 3) {
-        assert(indices[i] != RESTART_INDEX);
-        assert(indices[i + 1] != RESTART_INDEX);
-        assert(indices[i + 2] != RESTART_INDEX);
-
-        faces.push_back({
-            indices[i],
-            indices[i + 1],
-            indices[i + 2] //
-        });
+    glGenVertexArrays(1, &vao_);
+    glGenBuffers(1, &vbo_);
+    glGenBuffers(1, &ebo_);
+
+    glBindVertexArray(vao_);
+
+    // constant color means it doesn't need to be stored per vertex
+    const auto& color = mesh.vertices.front().color;
+    const bool is_single_color = std::all_of(mesh.vertices.begin(), mesh.vertices.end(), [&](const Vertex& vertex) {
+        return vertex.color == color;
+    });
+    if (is_single_color) {
+        init_packed_vertices(mesh);
+    } else {
+        init_full_vertices(mesh);
     }
-    return faces;
-}
 
-void Geometry::compute_faces()
-{
-    if (primitive_ == Primitive::triangle_strip) {
-        faces_ = compute_triangle_strip_faces(indices_);
-    } else if (primitive_ == Primitive::triangle_fan) {
-        faces_ = compute_triangle_fan_faces(indices_);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_);
+    if (mesh.vertices.size() < SHORT_RESTART_INDEX) {
+        // half the index memory and bandwidth
+        auto short_indices = vector<GLushort>(mesh.indices.size());
+        std::transform(mesh.indices.begin(), mesh.indices.end(), short_indices.begin(), [](VertexIndex index) {
+            return index == RESTART_INDEX ? SHORT_RESTART_INDEX : (GLushort) index;
+        });
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(GLushort) * short_indices.size(), short_indices.data(), GL_STATIC_DRAW);
+        index_type_ = GL_UNSIGNED_SHORT;
     } else {
-        assert(primitive_ == Primitive::triangles);
-        faces_ = compute_triangles_faces(indices_);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(VertexIndex) * mesh.indices.size(), (GLuint*) mesh.indices.data(), GL_STATIC_DRAW);
+        index_type_ = GL_UNSIGNED_INT;
     }
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
-float vectors_angle(const glm::vec3& vector_1, const glm::vec3& vector_2)
+void Geometry::init_full_vertices(const MeshData& mesh)
 {
-    return glm::acos(glm::dot(glm::normalize(vector_1), glm::normalize(vector_2)));
+    vertex_layout_ = VertexLayout::full;
+
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * mesh.vertices.size(), glm::value_ptr(mesh.vertices.front().position), GL_STATIC_DRAW);
+
+    glEnableVertexAttribArray(POSITION_LOCATION);
+    glVertexAttribPointer(POSITION_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*) offsetof(Vertex, position));
+    glEnableVertexAttribArray(NORMAL_LOCATION);
+    glVertexAttribPointer(NORMAL_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*) offsetof(Vertex, normal));
+    glEnableVertexAttribArray(COLOR_LOCATION);
+    glVertexAttribPointer(COLOR_LOCATION, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*) offsetof(Vertex, color));
 }
 
-void Geometry::compute_vertex_normals()
+// cf "A Survey of Efficient Representations for Independent Unit Vectors", Cigolle et al.
+static glm::vec2 encode_octahedral(const glm::vec3& normal)
 {
-    // TODO
-    for (auto& vertex : vertices_) {
-        vertex.normal = glm::vec3{ 0.0f };
+    const float l1_norm = std::abs(normal.x) + std::abs(normal.y) + std::abs(normal.z);
+    // unused normals are left null
+    if (l1_norm == 0.0f) {
+        return glm::vec2{ 0.0f, 0.0f };
     }
 
-    bool face_is_backwards = false;
-    for (auto& [index_1, index_2, index_3] : faces_) {
-        auto& vertex_1 = vertices_[index_1];
-        auto& vertex_2 = vertices_[index_2];
-        auto& vertex_3 = vertices_[index_3];
-
-        auto delta_2_1 = vertex_2.position - vertex_1.position;
-        auto delta_1_2 = vertex_1.position - vertex_2.position;
-        auto delta_3_2 = vertex_3.position - vertex_2.position;
-        auto delta_2_3 = vertex_2.position - vertex_3.position;
-        auto delta_3_1 = vertex_3.position - vertex_1.position;
-        auto delta_1_3 = vertex_1.position - vertex_3.position;
-
-        float angle_1 = vectors_angle(delta_2_1, delta_3_1);
-        float angle_2 = vectors_angle(delta_3_2, delta_1_2);
-        float angle_3 = vectors_angle(delta_1_3, delta_2_3);
-
-        auto face_normal = glm::cross(delta_3_1, delta_2_1);
-        if (primitive_ == Primitive::triangle_strip && face_is_backwards) {
-            face_normal *= -1.0;
-        }
+    auto encoded = glm::vec2{ normal.x / l1_norm, normal.y / l1_norm };
+    if (normal.z < 0.0f) {
+        // fold lower hemisphere over the diagonals
+        encoded = glm::vec2{
+            (1.0f - std::abs(encoded.y)) * (encoded.x >= 0.0f ? 1.0f : -1.0f),
+            (1.0f - std::abs(encoded.x)) * (encoded.y >= 0.0f ? 1.0f : -1.0f)
+        };
+    }
+    return encoded;
+}
 
-        vertex_1.normal += face_normal * angle_1;
-        vertex_2.normal += face_normal * angle_2;
-        vertex_3.normal += face_normal * angle_3;
+void Geometry::init_packed_vertices(const MeshData& mesh)
+{
+    vertex_layout_ = VertexLayout::packed;
+    color_ = mesh.vertices.front().color;
+
+    // dequantization is done in shaders, with constant attributes
+    const auto bounds = mesh.bounds.min.x <= mesh.bounds.max.x ? mesh.bounds : compute_bounds(mesh.vertices);
+    const float max_value = std::numeric_limits<GLushort>::max();
+    position_offset_ = bounds.min;
+    position_scale_ = bounds.max - bounds.min;
+    const auto quantization_scale = glm::vec3{
+        position_scale_.x > 0.0f ? max_value / position_scale_.x : 0.0f,
+        position_scale_.y > 0.0f ? max_value / position_scale_.y : 0.0f,
+        position_scale_.z > 0.0f ? max_value / position_scale_.z : 0.0f
+    };
 
-        face_is_backwards = !face_is_backwards;
+    auto vertices = vector<PackedVertex>(mesh.vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        const auto position = glm::round((mesh.vertices[i].position - position_offset_) * quantization_scale);
+        const auto normal = encode_octahedral(mesh.vertices[i].normal);
+        vertices[i] = PackedVertex{
+            { (GLushort) position.x, (GLushort) position.y, (GLushort) position.z },
+            0,
+            { (GLshort) std::round(normal.x * 32767.0f), (GLshort) std::round(normal.y * 32767.0f) }
+        };
     }
 
-    for (auto& vertex : vertices_) {
-        vertex.normal = glm::normalize(vertex.normal);
-    }
+    glBindBuffer(GL_ARRAY_BUFFER, vbo_);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(PackedVertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+
+    glEnableVertexAttribArray(POSITION_LOCATION);
+    glVertexAttribPointer(POSITION_LOCATION, 3, GL_UNSIGNED_SHORT, GL_TRUE, sizeof(PackedVertex), (GLvoid*) offsetof(PackedVertex, position));
+    glEnableVertexAttribArray(NORMAL_LOCATION);
+    glVertexAttribPointer(NORMAL_LOCATION, 2, GL_SHORT, GL_TRUE, sizeof(PackedVertex), (GLvoid*) offsetof(PackedVertex, normal));
+    // color is left disabled and set per draw
 }
 
-void Geometry::init_gl()
+void Geometry::set_instances(const vector<Instance>& instances)
 {
-    glGenVertexArrays(1, &vao_);
-    glGenBuffers(1, &vbo_);
-    glGenBuffers(1, &ebo_);
-
     glBindVertexArray(vao_);
+    if (instances_vbo_ == 0) {
+        glGenBuffers(1, &instances_vbo_);
+    }
 
-    glBindBuffer(GL_ARRAY_BUFFER, vbo_);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vertices_.size(), glm::value_ptr(vertices_.front().position), GL_STATIC_DRAW);
+    glBindBuffer(GL_ARRAY_BUFFER, instances_vbo_);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Instance) * instances.size(), instances.data(), GL_STATIC_DRAW);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo_);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(VertexIndex) * indices_.size(), (GLuint*) indices_.data(), GL_STATIC_DRAW);
-
-    // position
-    glEnableVertexAttribArray(0);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*) offsetof(Vertex, position));
-    // normal
-    glEnableVertexAttribArray(1);
-    glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*) offsetof(Vertex, normal));
-    // color
-    glEnableVertexAttribArray(2);
-    glVertexAttribPointer(2, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (GLvoid*) offsetof(Vertex, color));
+    // offset and scale, (0, 0, 0, 1) when not instanced
+    glEnableVertexAttribArray(INSTANCE_OFFSET_SCALE_LOCATION);
+    glVertexAttribPointer(INSTANCE_OFFSET_SCALE_LOCATION, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (GLvoid*) offsetof(Instance, offset_scale));
+    glVertexAttribDivisor(INSTANCE_OFFSET_SCALE_LOCATION, 1);
+    // rotation, identity when not instanced
+    glEnableVertexAttribArray(INSTANCE_ROTATION_LOCATION);
+    glVertexAttribPointer(INSTANCE_ROTATION_LOCATION, 4, GL_FLOAT, GL_FALSE, sizeof(Instance), (GLvoid*) offsetof(Instance, rotation));
+    glVertexAttribDivisor(INSTANCE_ROTATION_LOCATION, 1);
 
     glBindVertexArray(0);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    is_instanced_ = true;
+    instances_count_ = instances.size();
 }
 
 void Geometry::clear_gl()
@@ -179,22 +307,87 @@ void Geometry::clear_gl()
     glDeleteVertexArrays(1, &vao_);
     glDeleteBuffers(1, &vbo_);
     glDeleteBuffers(1, &ebo_);
+    if (instances_vbo_ != 0) {
+        glDeleteBuffers(1, &instances_vbo_);
+    }
 }
 
 void Geometry::draw() const
 {
     // TODO move
     glEnable(GL_PRIMITIVE_RESTART);
-    glPrimitiveRestartIndex(RESTART_INDEX);
+    // restart index has to match index width
+    glPrimitiveRestartIndex(index_type_ == GL_UNSIGNED_SHORT ? SHORT_RESTART_INDEX : RESTART_INDEX);
+
+    // constant attributes aren't part of the vertex array state
+    glVertexAttrib3fv(POSITION_OFFSET_LOCATION, glm::value_ptr(position_offset_));
+    glVertexAttrib3fv(POSITION_SCALE_LOCATION, glm::value_ptr(position_scale_));
+    glVertexAttrib1f(IS_PACKED_LOCATION, vertex_layout_ == VertexLayout::packed ? 1.0f : 0.0f);
+    if (vertex_layout_ == VertexLayout::packed) {
+        glVertexAttrib3fv(COLOR_LOCATION, glm::value_ptr(color_));
+    }
 
     glBindVertexArray(vao_);
     const GLenum mode = static_cast<typename std::underlying_type<Primitive>::type>(primitive_);
-    glDrawElements(mode, indices_.size(), GL_UNSIGNED_INT, 0);
+    const auto range = lods_.empty() ? IndexRange{ 0, indices_count_ } : lods_[lod_];
+    const auto offset = (GLvoid*) (range.begin * (index_type_ == GL_UNSIGNED_SHORT ? sizeof(GLushort) : sizeof(GLuint)));
+    if (is_instanced_) {
+        glDrawElementsInstanced(mode, range.count, index_type_, offset, instances_count_);
+    } else {
+        glDrawElements(mode, range.count, index_type_, offset);
+    }
 
     glBindVertexArray(0);
 }
 
-shared_ptr<Geometry> make_cube(float radius, const glm::vec3& color)
+static UnitCircle make_unit_circle(unsigned int segments_count)
+{
+    auto circle = UnitCircle{};
+    circle.cosines.resize(segments_count);
+    circle.sines.resize(segments_count);
+    for (unsigned int i = 0; i < segments_count; i++) {
+        const double angle = 2.0 * M_PI * (double) i / (double) segments_count;
+        circle.cosines[i] = std::cos(angle);
+        circle.sines[i] = std::sin(angle);
+    }
+    return circle;
+}
+
+const UnitCircle& get_unit_circle(unsigned int segments_count)
+{
+    // map nodes are never moved, so references stay valid while others are added
+    static auto circles = std::map<unsigned int, UnitCircle>{};
+    static auto circles_mutex = std::mutex{};
+
+    const auto lock = std::lock_guard<std::mutex>{ circles_mutex };
+    auto it = circles.find(segments_count);
+    if (it == circles.end()) {
+        it = circles.emplace(segments_count, make_unit_circle(segments_count)).first;
+    }
+    return it->second;
+}
+
+void append_ring(
+    vector<Vertex>& vertices,
+    const UnitCircle& circle,
+    const glm::vec3& point,
+    const Frame& frame,
+    const float radius,
+    const float radius_slope,
+    const glm::vec3& color)
+{
+    const auto scaled_binormal = frame.binormal * radius;
+    const auto scaled_normal = frame.normal * radius;
+    const auto tilt = frame.tangent * radius_slope;
+
+    for (unsigned int i = 0; i < circle.cosines.size(); i++) {
+        const auto radial = frame.binormal * circle.cosines[i] + frame.normal * circle.sines[i];
+        auto& vertex = vertices.emplace_back(point + scaled_binormal * circle.cosines[i] + scaled_normal * circle.sines[i], color);
+        vertex.normal = glm::normalize(tilt - radial);
+    }
+}
+
+MeshData make_cube(float radius, const glm::vec3& color, bool should_compute_normals)
 {
     auto vertices = vector<Vertex>{
         Vertex{ glm::vec3{ -1.0f, -1.0f, 1.0f } }, // bottom left front
@@ -225,38 +418,33 @@ shared_ptr<Geometry> make_cube(float radius, const glm::vec3& color)
         vertex.color = color;
     }
 
-    return make_shared<Geometry>(vertices, indices, Primitive::triangle_strip);
+    return make_mesh(std::move(vertices), std::move(indices), Primitive::triangle_strip, should_compute_normals);
 }
 
-shared_ptr<Geometry> make_cylinder(const unsigned int slices_count, const float height, const float radius, const glm::vec3& color)
+MeshData make_cylinder(const unsigned int slices_count, const float height, const float radius, const glm::vec3& color, bool should_compute_normals)
 {
     auto vertices = vector<Vertex>(slices_count * 2);
-    const float angle_factor = 2.0f * M_PI / (float) slices_count;
+    const auto& circle = get_unit_circle(slices_count);
 
     for (auto i = 0, j = 0; i < slices_count; i++) {
-        float angle = (float) i * angle_factor;
-        float x = std::cos(angle) * radius;
-        float z = std::sin(angle) * radius;
+        float x = circle.cosines[i] * radius;
+        float z = circle.sines[i] * radius;
 
-        vertices[j++] = Vertex{ glm::vec3{ x, height / 2.0f, z } };
-        vertices[j++] = Vertex{ glm::vec3{ x, -height / 2.0f, z } };
+        vertices[j++] = Vertex{ glm::vec3{ x, height / 2.0f, z }, color };
+        vertices[j++] = Vertex{ glm::vec3{ x, -height / 2.0f, z }, color };
     }
 
-    auto indices = vector<VertexIndex>(slices_count * 2);
-    std::iota(indices.begin(), indices.end(), 0);
+    auto indices = vector<VertexIndex>(slices_count * 2 + 2);
+    std::iota(indices.begin(), indices.end() - 2, 0);
     // loop back to first vertices at top and bottom
-    indices.push_back(0);
-    indices.push_back(1);
-
-    for (auto& vertex : vertices) {
-        vertex.color = color;
-    }
+    indices[slices_count * 2] = 0;
+    indices[slices_count * 2 + 1] = 1;
 
-    return make_shared<Geometry>(vertices, indices, Primitive::triangle_strip);
+    return make_mesh(std::move(vertices), std::move(indices), Primitive::triangle_strip, should_compute_normals);
 }
 
 // cf https://stackoverflow.com/a/33419880
-shared_ptr<Geometry> make_tube(
+MeshData make_tube(
     const Curve& curve,
     const unsigned int segments_count,
     const unsigned int radial_segments_count,
@@ -265,37 +453,91 @@ shared_ptr<Geometry> make_tube(
     bool should_draw_caps,
     const glm::vec3& color)
 {
-    auto vertices = vector<Vertex>{};
-
-    float radius = radius_begin;
-    const float radius_step = (radius_end - radius_begin) / segments_count;
-
+    auto xs = vector<float>(segments_count + 1);
     for (auto i = 0; i <= segments_count; i++) {
-        float x = (float) i / (float) (segments_count);
-        auto point = curve.get_point(x);
-        auto [_, binormal, normal] = curve.get_tbn(x);
-
-        // generate vertices for radial segment
-        auto radial_vertices = vector<Vertex>{};
-
-        const float angle_step = 2.0f * M_PI / (float) radial_segments_count;
-        float angle = 0.0;
+        xs[i] = (float) i / (float) (segments_count);
+    }
+    return make_tube(curve, xs, radial_segments_count, radius_begin, radius_end, should_draw_caps, color);
+}
 
-        for (auto j = 0; j < radial_segments_count; j++) {
-            float x = std::cos(angle) * radius;
-            float y = std::sin(angle) * radius;
-            radial_vertices.push_back(point + binormal * x + normal * y);
+MeshData make_tube(
+    const Curve& curve,
+    const vector<float>& xs,
+    const unsigned int radial_segments_count,
+    const float radius_begin,
+    const float radius_end,
+    bool should_draw_caps,
+    const glm::vec3& color)
+{
+    assert(xs.size() > 1);
+    const size_t segments_count = xs.size() - 1;
+    const size_t caps_count = should_draw_caps ? 2 : 0;
+
+    auto mesh = MeshData{};
+    mesh.primitive = Primitive::triangle_strip;
+    mesh.vertices.reserve(xs.size() * radial_segments_count + caps_count);
+    mesh.indices.reserve(segments_count * (2 * radial_segments_count + 3) + caps_count * (2 * radial_segments_count + 2));
+
+    append_tube(mesh, curve, xs, radial_segments_count, radius_begin, radius_end, nullptr, should_draw_caps, should_draw_caps, color);
+    mesh.bounds = compute_bounds(mesh.vertices);
+    return mesh;
+}
 
-            angle += angle_step;
+TubeEnd append_tube(
+    MeshData& mesh,
+    const Curve& curve,
+    const vector<float>& xs,
+    const unsigned int radial_segments_count,
+    const float radius_begin,
+    const float radius_end,
+    const TubeEnd* start,
+    bool should_draw_start_cap,
+    bool should_draw_end_cap,
+    const glm::vec3& color)
+{
+    assert(xs.size() > 1);
+    assert(mesh.primitive == Primitive::triangle_strip);
+    // a shared ring is already closed by the tube it comes from
+    assert(start == nullptr || !should_draw_start_cap);
+    const unsigned int segments_count = xs.size() - 1;
+    const auto& circle = get_unit_circle(radial_segments_count);
+    auto& vertices = mesh.vertices;
+    auto& indices = mesh.indices;
+
+    // evaluate the whole curve at once
+    auto points = vector<glm::vec3>(xs.size());
+    auto derivatives = vector<glm::vec3>(xs.size());
+    curve.get_points(xs.data(), xs.size(), points.data(), derivatives.data());
+
+    // first vertex of each ring, the first ring being the shared one if any
+    const VertexIndex first_ring = vertices.size();
+    auto get_ring = [&](unsigned int i) -> VertexIndex {
+        if (start == nullptr) {
+            return first_ring + i * radial_segments_count;
         }
+        return i == 0 ? start->ring : first_ring + (i - 1) * radial_segments_count;
+    };
 
-        vertices.insert(vertices.end(), radial_vertices.begin(), radial_vertices.end());
+    // frame is carried along the curve rather than recomputed, so that tubes don't twist, joints included
+    auto frame = start != nullptr ? start->frame : make_frame(derivatives.front());
 
-        radius += radius_step;
+    for (auto i = 0; i <= segments_count; i++) {
+        if (i > 0) {
+            frame = transport_frame(frame, points[i - 1], points[i], derivatives[i]);
+        } else if (start != nullptr) {
+            continue;
+        }
+        // normals are exact, taper included
+        const float speed = glm::length(derivatives[i]);
+        const float radius_slope = speed != 0.0f ? (radius_end - radius_begin) / speed : 0.0f;
+        append_ring(vertices, circle, points[i], frame, glm::mix(radius_begin, radius_end, xs[i]), radius_slope, color);
     }
+    const auto first_tangent = glm::normalize(derivatives.front());
 
-    // generate indices
-    auto indices = vector<VertexIndex>{};
+    // generate indices, each segment is a closed strip and a restart, each cap a restart and a closed fan-like strip
+    if (!indices.empty() && indices.back() != RESTART_INDEX) {
+        indices.push_back(RESTART_INDEX);
+    }
 
     // for (unsigned int i = 0; i <= segments_count; i++) {
     //     for (unsigned int j = 0; j < radial_segments_count; j++) {
@@ -305,8 +547,8 @@ shared_ptr<Geometry> make_tube(
     // }
 
     for (auto i = 1; i <= segments_count; i++) {
-        auto radial_before_begin = (i - 1) * radial_segments_count;
-        auto radial_begin = i * radial_segments_count;
+        auto radial_before_begin = get_ring(i - 1);
+        auto radial_begin = get_ring(i);
         for (auto j = 0; j < radial_segments_count; j++) {
             indices.push_back(radial_before_begin + j);
             indices.push_back(radial_begin + j);
@@ -315,31 +557,35 @@ shared_ptr<Geometry> make_tube(
         indices.push_back(radial_before_begin);
         indices.push_back(radial_begin);
 
-        indices.push_back(RESTART_INDEX); // TODO useless ?
+        // each segment is its own strip, optimize_mesh() turns them into a triangle list
+        indices.push_back(RESTART_INDEX);
     }
 
-    if (should_draw_caps) {
+    if (should_draw_start_cap) {
         // add vertex to center of first circle
-        vertices.push_back(curve.get_point(0.0f));
+        vertices.emplace_back(points.front(), color).normal = first_tangent;
         auto center_index = vertices.size() - 1;
 
         // draw disc
         indices.push_back(RESTART_INDEX);
+        auto radial_begin = get_ring(0);
         for (auto i = 0; i < radial_segments_count; i++) {
             if (i % 1 == 0) {
                 indices.push_back(center_index);
             }
-            indices.push_back(i);
+            indices.push_back(radial_begin + i);
         }
-        indices.push_back(0);
+        indices.push_back(radial_begin);
+    }
 
+    if (should_draw_end_cap) {
         // add vertex to center of last circle
-        vertices.push_back(curve.get_point(1.0f));
-        center_index = vertices.size() - 1;
+        vertices.emplace_back(points.back(), color).normal = -frame.tangent;
+        auto center_index = vertices.size() - 1;
 
         // draw disc
         indices.push_back(RESTART_INDEX);
-        auto radial_begin = segments_count * radial_segments_count;
+        auto radial_begin = get_ring(segments_count);
         for (auto i = 0; i < radial_segments_count; i++) {
             indices.push_back(radial_begin + i);
             if (i % 1 == 0) {
@@ -349,15 +595,11 @@ shared_ptr<Geometry> make_tube(
         indices.push_back(radial_begin);
     }
 
-    for (auto& vertex : vertices) {
-        vertex.color = color;
-    }
-
-    return make_shared<Geometry>(vertices, indices, Primitive::triangle_strip);
+    return { get_ring(segments_count), frame };
 }
 
 // cf https://github.com/mrdoob/three.js/blob/master/src/geometries/IcosahedronGeometry.js
-shared_ptr<Geometry> make_icosahedron(float radius, const glm::vec3& color)
+MeshData make_icosahedron(float radius, const glm::vec3& color, bool should_compute_normals)
 {
     // what is t ?
     float t = (1.0f + std::sqrt(5.0f)) / 2.0f;
@@ -397,6 +639,6 @@ shared_ptr<Geometry> make_icosahedron(float radius, const glm::vec3& color)
         vertex.color = color;
     }
 
-    return make_shared<Geometry>(vertices, indices, Primitive::triangles);
+    return make_mesh(std::move(vertices), std::move(indices), Primitive::triangles, should_compute_normals);
 }
 }
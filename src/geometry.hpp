@@ -1,7 +1,10 @@
 #pragma once
 #include "curve.hpp"
 #include "glad.hpp"
+#include <algorithm>
 #include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <limits>
 #include <memory>
 #include <utility>
 #include <vector>
@@ -9,7 +12,9 @@
 namespace lindenmaker {
 
 using VertexIndex = unsigned int;
-using Face = std::tuple<VertexIndex, VertexIndex, VertexIndex>;
+
+/** Ends a strip or fan, can't collide with a vertex index whatever the mesh size */
+const VertexIndex RESTART_INDEX = std::numeric_limits<VertexIndex>::max();
 
 enum class Primitive : GLenum
 {
@@ -30,38 +35,155 @@ struct Vertex
     Vertex(glm::vec3 position, glm::vec3 color);
 };
 
+/** Per instance transform: rotation, then uniform scale, then offset */
+struct Instance
+{
+    glm::vec4 offset_scale = glm::vec4{ 0.0f, 0.0f, 0.0f, 1.0f };
+    // quaternion as x, y, z, w
+    glm::vec4 rotation = glm::vec4{ 0.0f, 0.0f, 0.0f, 1.0f };
+
+    Instance() = default;
+    Instance(const glm::vec3& offset, float scale, const glm::quat& rotation);
+};
+
+/** Axis aligned box */
+struct Bounds
+{
+    glm::vec3 min = glm::vec3{ std::numeric_limits<float>::max() };
+    glm::vec3 max = glm::vec3{ std::numeric_limits<float>::lowest() };
+
+    void add(const glm::vec3& point)
+    {
+        min = glm::min(min, point);
+        max = glm::max(max, point);
+    }
+};
+
+struct IndexRange
+{
+    std::size_t begin;
+    std::size_t count;
+};
+
+/** Mesh on the CPU side, built without GL so that it can be done on any thread */
+struct MeshData
+{
+    std::vector<Vertex> vertices;
+    std::vector<VertexIndex> indices;
+    Primitive primitive = Primitive::triangles;
+    Bounds bounds;
+    // levels of detail sharing vertices, finest first, none meaning all indices
+    std::vector<IndexRange> lods;
+};
+
+Bounds compute_bounds(const std::vector<Vertex>& vertices);
+
+/** Same triangles, listed three indices at a time with the same winding */
+std::vector<VertexIndex> to_triangle_list(const std::vector<VertexIndex>& indices, Primitive primitive);
+
+/**
+ * All meshes in a single one, so that they can be drawn at once.
+ * Meshes must share their primitive and have no levels of detail, strips and fans are separated by restarts.
+ */
+MeshData merge_meshes(const std::vector<MeshData>& meshes);
+
+/** Sets vertex normals from faces, facing away from front faces like shaders expect */
+void compute_normals(MeshData& mesh);
+
+/** How vertices are stored on the GPU */
+enum class VertexLayout
+{
+    // float position, normal and color, 36 bytes
+    full,
+    // 16 bit positions relative to bounds, octahedral 16 bit normals, color set per draw, 12 bytes
+    packed
+};
+
+/**
+ * Mesh uploaded to GPU buffers, CPU side arrays are not kept.
+ * Small meshes get 16 bit indices, meshes of a single color get the packed layout.
+ */
 class Geometry
 {
 public:
-    Geometry(const std::vector<Vertex>& vertices, const std::vector<VertexIndex>& indices, Primitive primitive);
+    /** Needs a current GL context, uploads straight from mesh arrays */
+    Geometry(const MeshData& mesh);
     ~Geometry() { clear_gl(); }
 
+    // owns GL buffers
+    Geometry(const Geometry&) = delete;
+    Geometry& operator=(const Geometry&) = delete;
+
+    const Bounds& get_bounds() const { return bounds_; }
+    VertexLayout get_vertex_layout() const { return vertex_layout_; }
+    /** Once set, the mesh is drawn once per instance in a single call */
+    void set_instances(const std::vector<Instance>& instances);
+    std::size_t get_lods_count() const { return std::max<std::size_t>(lods_.size(), 1); }
+    /** Level of detail drawn, clamped to the coarsest one */
+    void set_lod(std::size_t lod) { lod_ = std::min(lod, get_lods_count() - 1); }
     void draw() const;
 
 private:
-    std::vector<Vertex> vertices_;
-    std::vector<VertexIndex> indices_;
     Primitive primitive_;
-    std::vector<Face> faces_;
+    std::size_t indices_count_;
+    // GL_UNSIGNED_SHORT or GL_UNSIGNED_INT
+    GLenum index_type_;
+    Bounds bounds_;
+    VertexLayout vertex_layout_ = VertexLayout::full;
+    // packed layout only, set as constant attributes at draw
+    glm::vec3 color_ = glm::vec3{ 1.0f };
+    glm::vec3 position_offset_ = glm::vec3{ 0.0f };
+    glm::vec3 position_scale_ = glm::vec3{ 1.0f };
+    std::vector<IndexRange> lods_;
+    std::size_t lod_ = 0;
+    bool is_instanced_ = false;
+    std::size_t instances_count_ = 0;
     GLuint vao_, vbo_, ebo_;
+    GLuint instances_vbo_ = 0;
 
-    void compute_faces();
-    void compute_vertex_normals();
-    void init_gl();
+    void init_gl(const MeshData& mesh);
+    void init_full_vertices(const MeshData& mesh);
+    void init_packed_vertices(const MeshData& mesh);
     void clear_gl();
 };
 
-std::shared_ptr<Geometry> make_cube(
+/** Cosines and sines of angles evenly spread around the circle, starting at 0 */
+struct UnitCircle
+{
+    std::vector<float> cosines;
+    std::vector<float> sines;
+};
+
+/** Cached per segments count, thread safe */
+const UnitCircle& get_unit_circle(unsigned int segments_count);
+
+/**
+ * Appends a ring of tube vertices around point, in the plane of frame normal and binormal.
+ * Normals are tilted by radius_slope, the change of radius per unit of length along the tangent,
+ * and face inwards like those of compute_normals(), which shaders expect.
+ */
+void append_ring(
+    std::vector<Vertex>& vertices,
+    const UnitCircle& circle,
+    const glm::vec3& point,
+    const Frame& frame,
+    float radius,
+    float radius_slope,
+    const glm::vec3& color);
+
+MeshData make_cube(
     float radius = 1.0f,
-    const glm::vec3& color = glm::vec3{ 1.0f });
+    const glm::vec3& color = glm::vec3{ 1.0f },
+    bool should_compute_normals = true);
 
-std::shared_ptr<Geometry> make_cylinder(
+MeshData make_cylinder(
     unsigned int slices_count,
     float height = 1.0f,
     float radius = 1.0f,
-    const glm::vec3& color = glm::vec3{ 1.0f });
+    const glm::vec3& color = glm::vec3{ 1.0f },
+    bool should_compute_normals = true);
 
-std::shared_ptr<Geometry> make_tube(
+MeshData make_tube(
     const Curve& curve,
     unsigned int segments_count,
     unsigned int radial_segments_count,
@@ -70,7 +192,46 @@ std::shared_ptr<Geometry> make_tube(
     bool should_draw_caps = true,
     const glm::vec3& color = glm::vec3{ 1.0f });
 
-std::shared_ptr<Geometry> make_icosahedron(
-    float radius = 1.0f,
+/**
+ * Same as above with a ring at each of xs, increasing from 0 to 1, normals come from ring frames.
+ * Vertex and index counts are known up front, so buffers are allocated once.
+ */
+MeshData make_tube(
+    const Curve& curve,
+    const std::vector<float>& xs,
+    unsigned int radial_segments_count,
+    float radius_begin = 1.0f,
+    float radius_end = 1.0f,
+    bool should_draw_caps = true,
     const glm::vec3& color = glm::vec3{ 1.0f });
+
+/** Last ring of a tube, which another tube can start from */
+struct TubeEnd
+{
+    // first vertex of the ring
+    VertexIndex ring;
+    Frame frame;
+};
+
+/**
+ * Appends a tube like the one above to a triangle strip mesh, with caps at either end.
+ * If start is given, the tube starts from that ring of mesh, e.g. the end of its parent at a fork,
+ * instead of having its own first ring, and never gets a start cap.
+ */
+TubeEnd append_tube(
+    MeshData& mesh,
+    const Curve& curve,
+    const std::vector<float>& xs,
+    unsigned int radial_segments_count,
+    float radius_begin,
+    float radius_end,
+    const TubeEnd* start,
+    bool should_draw_start_cap,
+    bool should_draw_end_cap,
+    const glm::vec3& color);
+
+MeshData make_icosahedron(
+    float radius = 1.0f,
+    const glm::vec3& color = glm::vec3{ 1.0f },
+    bool should_compute_normals = true);
 }
@@ -0,0 +1,106 @@
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <glm/glm.hpp>
+#if defined(__SSE__) || defined(__AVX__)
+#include <immintrin.h>
+#endif
+
+namespace lindenmaker {
+
+#ifdef __AVX__
+const std::size_t LANES_COUNT = 8;
+#else
+const std::size_t LANES_COUNT = 4;
+#endif
+
+// GCC/Clang vector extension, compiled to SSE or AVX registers
+typedef float Lanes __attribute__((vector_size(LANES_COUNT * sizeof(float))));
+typedef int LaneInts __attribute__((vector_size(LANES_COUNT * sizeof(int))));
+
+struct LaneVector
+{
+    Lanes x, y, z;
+};
+
+inline Lanes broadcast(float value)
+{
+    return Lanes{} + value;
+}
+
+inline glm::vec3 get_lane(const LaneVector& vector, std::size_t lane)
+{
+    return glm::vec3{ vector.x[lane], vector.y[lane], vector.z[lane] };
+}
+
+inline void set_lane(LaneVector& vector, std::size_t lane, const glm::vec3& value)
+{
+    vector.x[lane] = value.x;
+    vector.y[lane] = value.y;
+    vector.z[lane] = value.z;
+}
+
+/**
+ * Sine and cosine of every lane, with float precision for angles of moderate magnitude
+ * cf. Cephes sinf() and cosf()
+ */
+inline void sincos(Lanes angles, Lanes& sines, Lanes& cosines)
+{
+    // sine is odd, cosine is even
+    const auto negatives = __builtin_convertvector(angles < 0.0f, Lanes);
+    angles *= 1.0f + 2.0f * negatives;
+
+    // octant, rounded to even so that reduced angle is in [-pi/4, pi/4]
+    auto octants = __builtin_convertvector(angles * (float) (4.0 / M_PI), LaneInts);
+    octants = (octants + 1) & ~1;
+    const auto octants_float = __builtin_convertvector(octants, Lanes);
+
+    // extended precision subtraction of octants * pi/4
+    auto x = angles - octants_float * 0.78515625f;
+    x -= octants_float * 2.4187564849853515625e-4f;
+    x -= octants_float * 3.77489497744594108e-8f;
+    const auto z = x * x;
+
+    const auto sine = ((-1.9515295891e-4f * z + 8.3321608736e-3f) * z - 1.6666654611e-1f) * z * x + x;
+    const auto cosine = ((2.443315711809948e-5f * z - 1.388731625493765e-3f) * z + 4.166664568298827e-2f) * z * z - 0.5f * z + 1.0f;
+
+    // quadrant 0 to 3: sin = sin, cos, -sin, -cos and cos = cos, -sin, -cos, sin
+    const auto quadrants = octants >> 1;
+    const auto swap = __builtin_convertvector(quadrants & 1, Lanes);
+    const auto sine_sign = (1.0f + 2.0f * negatives) * (1.0f - 2.0f * __builtin_convertvector((quadrants >> 1) & 1, Lanes));
+    const auto cosine_sign = 1.0f - 2.0f * __builtin_convertvector(((quadrants + 1) >> 1) & 1, Lanes);
+
+    sines = sine_sign * (swap * cosine + (1.0f - swap) * sine);
+    cosines = cosine_sign * (swap * sine + (1.0f - swap) * cosine);
+}
+
+inline Lanes lane_sqrt(Lanes values)
+{
+#if defined(__AVX__)
+    return (Lanes) _mm256_sqrt_ps((__m256) values);
+#elif defined(__SSE__)
+    return (Lanes) _mm_sqrt_ps((__m128) values);
+#else
+    for (std::size_t lane = 0; lane < LANES_COUNT; lane++) {
+        values[lane] = std::sqrt(values[lane]);
+    }
+    return values;
+#endif
+}
+
+/**
+ * acos with absolute error below 7e-5, inputs being clamped to [-1, 1]
+ * cf. Abramowitz and Stegun 4.4.45
+ */
+inline Lanes fast_acos(Lanes values)
+{
+    // acos(-x) = pi - acos(x)
+    const auto negatives = __builtin_convertvector(values < 0.0f, Lanes);
+    const auto signs = 1.0f + 2.0f * negatives;
+    auto x = values * signs;
+    x += (x - 1.0f) * __builtin_convertvector(x > 1.0f, Lanes);
+
+    const auto polynomial = ((-0.0187293f * x + 0.0742610f) * x - 0.2121144f) * x + 1.5707288f;
+    return lane_sqrt(1.0f - x) * polynomial * signs - negatives * (float) M_PI;
+}
+}
@@ -9,6 +9,7 @@
 #include <iostream>
 #include <memory>
 #include <thread>
+#include <vector>
 
 using namespace lindenmaker;
 
@@ -18,6 +19,12 @@ const int HEIGHT = 600;
 const float KEYBOARD_ROTATION_SPEED = 1.0f;
 const float SCROLL_ZOOM_SPEED = 15.0f; // smaller => faster
 const bool DONT_BURN_MY_GPU = true;
+// curve kernels per branch depth, cycled through with K
+const auto CURVE_KERNEL_PRESETS = std::vector<std::vector<CurveKernel>>{
+    { CurveKernel::catmull_rom },
+    { CurveKernel::b_spline },
+    { CurveKernel::catmull_rom, CurveKernel::catmull_rom, CurveKernel::b_spline, CurveKernel::b_spline, CurveKernel::polyline }
+};
 
 Scene* scene = nullptr;
 Camera* camera = nullptr;
@@ -25,6 +32,7 @@ Camera* camera = nullptr;
 static float prev_frame = 0.0f;
 static float scale = 1.0f;
 static float x_rotation = 0.0f, y_rotation = 0.0f;
+static size_t curve_kernel_preset = 0;
 
 void handle_resize(int width, int height)
 {
@@ -63,6 +71,28 @@ void handle_keyboard(GLFWwindow* window)
     prev_frame = current_frame;
 }
 
+void handle_key(int key, int action)
+{
+    // toggle fused meshing and regenerate
+    if (key == GLFW_KEY_F && action == GLFW_PRESS) {
+        scene->set_fused_meshing(!scene->is_fused_meshing());
+        scene->gen_tree();
+    }
+
+    // toggle shared joints and regenerate
+    if (key == GLFW_KEY_J && action == GLFW_PRESS) {
+        scene->set_shared_joints(!scene->has_shared_joints());
+        scene->gen_tree();
+    }
+
+    // next curve kernel preset and regenerate
+    if (key == GLFW_KEY_K && action == GLFW_PRESS) {
+        curve_kernel_preset = (curve_kernel_preset + 1) % CURVE_KERNEL_PRESETS.size();
+        scene->set_curve_kernels(CURVE_KERNEL_PRESETS[curve_kernel_preset]);
+        scene->gen_tree();
+    }
+}
+
 void handle_scroll(double y_offset)
 {
     scale += y_offset / SCROLL_ZOOM_SPEED;
@@ -101,6 +131,9 @@ int main(int, char**)
     glfwSetScrollCallback(window, [](GLFWwindow*, double, double y_offset) {
         handle_scroll(y_offset);
     });
+    glfwSetKeyCallback(window, [](GLFWwindow*, int key, int, int action, int) {
+        handle_key(key, action);
+    });
 
     if (!gladLoadGLLoader((GLADloadproc) glfwGetProcAddress)) {
         std::cerr << "Failed to initialize GLAD\n";
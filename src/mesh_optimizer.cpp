@@ -0,0 +1,215 @@
+#include "mesh_optimizer.hpp"
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include <numeric>
+
+namespace lindenmaker {
+
+using std::size_t;
+using std::vector;
+
+const VertexIndex UNUSED_VERTEX = std::numeric_limits<VertexIndex>::max();
+
+static size_t get_vertices_count(const vector<VertexIndex>& triangles)
+{
+    if (triangles.empty()) {
+        return 0;
+    }
+    return *std::max_element(triangles.begin(), triangles.end()) + 1;
+}
+
+float compute_acmr(const vector<VertexIndex>& triangles, unsigned int cache_size)
+{
+    assert(triangles.size() % 3 == 0);
+    if (triangles.empty()) {
+        return 0.0f;
+    }
+
+    // vertex is cached if inserted less than cache_size misses ago
+    auto timestamps = vector<size_t>(get_vertices_count(triangles), 0);
+    size_t time = cache_size + 1;
+    for (const auto vertex : triangles) {
+        if (time - timestamps[vertex] > cache_size) {
+            timestamps[vertex] = time++;
+        }
+    }
+
+    const size_t misses_count = time - cache_size - 1;
+    return (float) misses_count / (float) (triangles.size() / 3);
+}
+
+/** Triangles around each vertex */
+struct VertexTriangles
+{
+    // triangles of vertex v are indices[offsets[v]] to indices[offsets[v + 1]]
+    vector<size_t> offsets;
+    vector<size_t> indices;
+};
+
+static VertexTriangles make_vertex_triangles(const vector<VertexIndex>& triangles, size_t vertices_count)
+{
+    auto adjacency = VertexTriangles{};
+    adjacency.offsets.resize(vertices_count + 1, 0);
+    for (const auto vertex : triangles) {
+        adjacency.offsets[vertex + 1]++;
+    }
+    std::partial_sum(adjacency.offsets.begin(), adjacency.offsets.end(), adjacency.offsets.begin());
+
+    auto cursors = vector<size_t>(adjacency.offsets.begin(), adjacency.offsets.end() - 1);
+    adjacency.indices.resize(triangles.size());
+    for (size_t i = 0; i < triangles.size(); i++) {
+        adjacency.indices[cursors[triangles[i]]++] = i / 3;
+    }
+    return adjacency;
+}
+
+vector<VertexIndex> optimize_vertex_cache(const vector<VertexIndex>& triangles, size_t vertices_count, unsigned int cache_size)
+{
+    assert(triangles.size() % 3 == 0);
+    const auto adjacency = make_vertex_triangles(triangles, vertices_count);
+    const size_t triangles_count = triangles.size() / 3;
+
+    // triangles not emitted yet around each vertex
+    auto live_counts = vector<size_t>(vertices_count);
+    for (size_t i = 0; i < vertices_count; i++) {
+        live_counts[i] = adjacency.offsets[i + 1] - adjacency.offsets[i];
+    }
+    auto timestamps = vector<size_t>(vertices_count, 0);
+    size_t time = cache_size + 1;
+    auto is_emitted = vector<bool>(triangles_count, false);
+    // recently used vertices to restart from when stuck
+    auto dead_end_stack = vector<VertexIndex>{};
+    auto candidates = vector<VertexIndex>{};
+    size_t cursor = 0;
+
+    auto optimized = vector<VertexIndex>{};
+    optimized.reserve(triangles.size());
+
+    auto skip_dead_end = [&]() -> size_t {
+        while (!dead_end_stack.empty()) {
+            const auto vertex = dead_end_stack.back();
+            dead_end_stack.pop_back();
+            if (live_counts[vertex] > 0) {
+                return vertex;
+            }
+        }
+        for (; cursor < vertices_count; cursor++) {
+            if (live_counts[cursor] > 0) {
+                return cursor;
+            }
+        }
+        return vertices_count;
+    };
+
+    // fanning vertex
+    size_t fanning = skip_dead_end();
+    while (fanning < vertices_count) {
+        candidates.clear();
+
+        for (size_t i = adjacency.offsets[fanning]; i < adjacency.offsets[fanning + 1]; i++) {
+            const auto triangle = adjacency.indices[i];
+            if (is_emitted[triangle]) {
+                continue;
+            }
+            is_emitted[triangle] = true;
+
+            for (size_t j = triangle * 3; j < triangle * 3 + 3; j++) {
+                const auto vertex = triangles[j];
+                optimized.push_back(vertex);
+                dead_end_stack.push_back(vertex);
+                candidates.push_back(vertex);
+                live_counts[vertex]--;
+                if (time - timestamps[vertex] > cache_size) {
+                    timestamps[vertex] = time++;
+                }
+            }
+        }
+
+        // next fanning vertex is the one staying longest in cache that still has triangles,
+        // if its triangles won't push it out of cache
+        size_t next = vertices_count;
+        long best_priority = -1;
+        for (const auto vertex : candidates) {
+            if (live_counts[vertex] == 0) {
+                continue;
+            }
+            long priority = 0;
+            if (time - timestamps[vertex] + 2 * live_counts[vertex] <= cache_size) {
+                priority = time - timestamps[vertex];
+            }
+            if (priority > best_priority) {
+                best_priority = priority;
+                next = vertex;
+            }
+        }
+        fanning = next < vertices_count ? next : skip_dead_end();
+    }
+
+    assert(optimized.size() == triangles.size());
+    return optimized;
+}
+
+void optimize_vertex_fetch(vector<Vertex>& vertices, vector<VertexIndex>& triangles)
+{
+    auto remap = vector<VertexIndex>(vertices.size(), UNUSED_VERTEX);
+    VertexIndex next_index = 0;
+    for (auto& vertex : triangles) {
+        if (remap[vertex] == UNUSED_VERTEX) {
+            remap[vertex] = next_index++;
+        }
+        vertex = remap[vertex];
+    }
+    for (auto& index : remap) {
+        if (index == UNUSED_VERTEX) {
+            index = next_index++;
+        }
+    }
+
+    auto reordered = vector<Vertex>(vertices.size());
+    for (size_t i = 0; i < vertices.size(); i++) {
+        reordered[remap[i]] = vertices[i];
+    }
+    vertices = std::move(reordered);
+}
+
+MeshOptimizationStats& MeshOptimizationStats::operator+=(const MeshOptimizationStats& other)
+{
+    const size_t total_count = triangles_count + other.triangles_count;
+    if (total_count == 0) {
+        return *this;
+    }
+    const float weight = (float) other.triangles_count / (float) total_count;
+    acmr_before = glm::mix(acmr_before, other.acmr_before, weight);
+    acmr_after = glm::mix(acmr_after, other.acmr_after, weight);
+    triangles_count = total_count;
+    return *this;
+}
+
+MeshOptimizationStats optimize_mesh(MeshData& mesh, unsigned int cache_size)
+{
+    // levels of detail would be lost
+    assert(mesh.lods.empty());
+    auto stats = MeshOptimizationStats{};
+    if (mesh.primitive == Primitive::lines) {
+        return stats;
+    }
+
+    auto triangles = to_triangle_list(mesh.indices, mesh.primitive);
+    stats.triangles_count = triangles.size() / 3;
+    stats.acmr_before = compute_acmr(triangles, cache_size);
+
+    // narrow tubes emitted ring by ring already fit in cache, better than what Tipsify gives
+    auto reordered = optimize_vertex_cache(triangles, mesh.vertices.size(), cache_size);
+    const float reordered_acmr = compute_acmr(reordered, cache_size);
+    if (reordered_acmr < stats.acmr_before) {
+        triangles = std::move(reordered);
+    }
+    stats.acmr_after = std::min(reordered_acmr, stats.acmr_before);
+    optimize_vertex_fetch(mesh.vertices, triangles);
+
+    mesh.indices = std::move(triangles);
+    mesh.primitive = Primitive::triangles;
+    return stats;
+}
+}
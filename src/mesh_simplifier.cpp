@@ -0,0 +1,317 @@
+#include "mesh_simplifier.hpp"
+#include "mesh_optimizer.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <functional>
+#include <iterator>
+#include <queue>
+#include <unordered_map>
+
+namespace lindenmaker {
+
+using std::size_t;
+using std::vector;
+
+/** Sum of squared distances to planes, as the upper triangle of a symmetric 4x4 matrix */
+struct Quadric
+{
+    std::array<double, 10> coefs = {};
+
+    static Quadric from_plane(const glm::vec3& normal, float distance)
+    {
+        const double a = normal.x, b = normal.y, c = normal.z, d = distance;
+        return { { a * a, a * b, a * c, a * d, b * b, b * c, b * d, c * c, c * d, d * d } };
+    }
+
+    Quadric& operator+=(const Quadric& other)
+    {
+        for (size_t i = 0; i < coefs.size(); i++) {
+            coefs[i] += other.coefs[i];
+        }
+        return *this;
+    }
+
+    double evaluate(const glm::vec3& point) const
+    {
+        const double x = point.x, y = point.y, z = point.z;
+        const auto& q = coefs;
+        return q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x
+            + q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y
+            + q[7] * z * z + 2.0 * q[8] * z
+            + q[9];
+    }
+};
+
+/** Moving vertex from onto vertex to, valid while both versions are unchanged */
+struct Collapse
+{
+    double cost;
+    VertexIndex from, to;
+    unsigned int from_version, to_version;
+
+    bool operator>(const Collapse& other) const { return cost > other.cost; }
+};
+
+static glm::vec3 get_normal(const glm::vec3& a, const glm::vec3& b, const glm::vec3& c)
+{
+    return glm::cross(b - a, c - a);
+}
+
+/** Simplifier state, triangles being removed or having vertices replaced in place */
+class Simplifier
+{
+public:
+    Simplifier(const vector<Vertex>& vertices, const vector<VertexIndex>& triangles)
+        : vertices_(vertices),
+          triangles_(triangles),
+          live_triangles_count_(triangles.size() / 3),
+          is_removed_(triangles.size() / 3, false),
+          vertex_triangles_(vertices.size()),
+          quadrics_(vertices.size()),
+          is_locked_(vertices.size(), false),
+          is_collapsed_(vertices.size(), false),
+          versions_(vertices.size(), 0)
+    {
+        init_triangles();
+        for (size_t i = 0; i < triangles_.size(); i += 3) {
+            for (size_t j = 0; j < 3; j++) {
+                push_collapse(triangles_[i + j], triangles_[i + (j + 1) % 3]);
+            }
+        }
+    }
+
+    vector<VertexIndex> run(size_t target_triangles_count, double max_error)
+    {
+        while (live_triangles_count_ > target_triangles_count && !collapses_.empty()) {
+            const auto collapse = collapses_.top();
+            collapses_.pop();
+
+            if (is_collapsed_[collapse.from] || is_collapsed_[collapse.to]
+                || versions_[collapse.from] != collapse.from_version || versions_[collapse.to] != collapse.to_version) {
+                continue;
+            }
+            if (collapse.cost > max_error) {
+                break;
+            }
+            if (!is_valid(collapse.from, collapse.to)) {
+                continue;
+            }
+            apply(collapse.from, collapse.to);
+        }
+
+        auto simplified = vector<VertexIndex>{};
+        simplified.reserve(live_triangles_count_ * 3);
+        for (size_t i = 0; i < is_removed_.size(); i++) {
+            if (!is_removed_[i]) {
+                simplified.insert(simplified.end(), triangles_.begin() + i * 3, triangles_.begin() + i * 3 + 3);
+            }
+        }
+        return simplified;
+    }
+
+private:
+    const vector<Vertex>& vertices_;
+    vector<VertexIndex> triangles_;
+    size_t live_triangles_count_;
+    vector<bool> is_removed_;
+    vector<vector<size_t>> vertex_triangles_;
+    vector<Quadric> quadrics_;
+    // boundary vertices never move
+    vector<bool> is_locked_;
+    vector<bool> is_collapsed_;
+    vector<unsigned int> versions_;
+    std::priority_queue<Collapse, vector<Collapse>, std::greater<Collapse>> collapses_;
+
+    const glm::vec3& get_position(VertexIndex vertex) const { return vertices_[vertex].position; }
+
+    void init_triangles()
+    {
+        // triangles per undirected edge, boundary edges having one
+        auto edge_counts = std::unordered_map<unsigned long long, unsigned int>{};
+        auto get_edge_key = [](VertexIndex a, VertexIndex b) {
+            return ((unsigned long long) std::min(a, b) << 32) | std::max(a, b);
+        };
+
+        for (size_t i = 0; i < triangles_.size(); i += 3) {
+            const auto normal = get_normal(get_position(triangles_[i]), get_position(triangles_[i + 1]), get_position(triangles_[i + 2]));
+            const float length = glm::length(normal);
+            const auto plane = length > 0.0f
+                ? Quadric::from_plane(normal / length, -glm::dot(normal / length, get_position(triangles_[i])))
+                : Quadric{};
+
+            for (size_t j = 0; j < 3; j++) {
+                const auto vertex = triangles_[i + j];
+                vertex_triangles_[vertex].push_back(i / 3);
+                quadrics_[vertex] += plane;
+                edge_counts[get_edge_key(vertex, triangles_[i + (j + 1) % 3])]++;
+            }
+        }
+
+        for (size_t i = 0; i < triangles_.size(); i += 3) {
+            for (size_t j = 0; j < 3; j++) {
+                const auto a = triangles_[i + j];
+                const auto b = triangles_[i + (j + 1) % 3];
+                if (edge_counts[get_edge_key(a, b)] == 1) {
+                    is_locked_[a] = true;
+                    is_locked_[b] = true;
+                }
+            }
+        }
+    }
+
+    void push_collapse(VertexIndex a, VertexIndex b)
+    {
+        if (a == b || vertices_[a].color != vertices_[b].color) {
+            return;
+        }
+
+        auto quadric = quadrics_[a];
+        quadric += quadrics_[b];
+        // half edge collapse onto the vertex giving the least error, so that no vertex is created
+        const double infinity = std::numeric_limits<double>::infinity();
+        const double a_to_b_cost = is_locked_[a] ? infinity : quadric.evaluate(get_position(b));
+        const double b_to_a_cost = is_locked_[b] ? infinity : quadric.evaluate(get_position(a));
+        if (a_to_b_cost == infinity && b_to_a_cost == infinity) {
+            return;
+        }
+
+        if (a_to_b_cost <= b_to_a_cost) {
+            collapses_.push({ a_to_b_cost, a, b, versions_[a], versions_[b] });
+        } else {
+            collapses_.push({ b_to_a_cost, b, a, versions_[b], versions_[a] });
+        }
+    }
+
+    bool contains(size_t triangle, VertexIndex vertex) const
+    {
+        const auto begin = triangles_.begin() + triangle * 3;
+        return std::find(begin, begin + 3, vertex) != begin + 3;
+    }
+
+    vector<VertexIndex> get_neighbors(VertexIndex vertex) const
+    {
+        auto neighbors = vector<VertexIndex>{};
+        for (const auto triangle : vertex_triangles_[vertex]) {
+            if (is_removed_[triangle]) {
+                continue;
+            }
+            for (size_t j = triangle * 3; j < triangle * 3 + 3; j++) {
+                if (triangles_[j] != vertex) {
+                    neighbors.push_back(triangles_[j]);
+                }
+            }
+        }
+        std::sort(neighbors.begin(), neighbors.end());
+        neighbors.erase(std::unique(neighbors.begin(), neighbors.end()), neighbors.end());
+        return neighbors;
+    }
+
+    bool is_valid(VertexIndex from, VertexIndex to) const
+    {
+        // link condition, shared neighbors must only be those of triangles around the edge, or the surface pinches
+        size_t shared_triangles_count = 0;
+        for (const auto triangle : vertex_triangles_[from]) {
+            shared_triangles_count += !is_removed_[triangle] && contains(triangle, to);
+        }
+        if (shared_triangles_count == 0) {
+            return false;
+        }
+        const auto from_neighbors = get_neighbors(from);
+        const auto to_neighbors = get_neighbors(to);
+        auto shared_neighbors = vector<VertexIndex>{};
+        std::set_intersection(from_neighbors.begin(), from_neighbors.end(), to_neighbors.begin(), to_neighbors.end(), std::back_inserter(shared_neighbors));
+        if (shared_neighbors.size() != shared_triangles_count) {
+            return false;
+        }
+
+        // triangles moving with from must not flip nor become degenerate
+        for (const auto triangle : vertex_triangles_[from]) {
+            if (is_removed_[triangle] || contains(triangle, to)) {
+                continue;
+            }
+            auto corners = std::array<glm::vec3, 3>{};
+            for (size_t j = 0; j < 3; j++) {
+                corners[j] = get_position(triangles_[triangle * 3 + j]);
+            }
+            const auto old_normal = get_normal(corners[0], corners[1], corners[2]);
+            for (size_t j = 0; j < 3; j++) {
+                if (triangles_[triangle * 3 + j] == from) {
+                    corners[j] = get_position(to);
+                }
+            }
+            const auto new_normal = get_normal(corners[0], corners[1], corners[2]);
+            if (glm::dot(old_normal, new_normal) <= 0.0f) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void apply(VertexIndex from, VertexIndex to)
+    {
+        for (const auto triangle : vertex_triangles_[from]) {
+            if (is_removed_[triangle]) {
+                continue;
+            }
+            if (contains(triangle, to)) {
+                is_removed_[triangle] = true;
+                live_triangles_count_--;
+                continue;
+            }
+            std::replace(triangles_.begin() + triangle * 3, triangles_.begin() + triangle * 3 + 3, from, to);
+            vertex_triangles_[to].push_back(triangle);
+        }
+        vertex_triangles_[from].clear();
+
+        auto& to_triangles = vertex_triangles_[to];
+        to_triangles.erase(std::remove_if(to_triangles.begin(), to_triangles.end(), [&](size_t triangle) {
+            return is_removed_[triangle];
+        }),
+            to_triangles.end());
+
+        is_collapsed_[from] = true;
+        quadrics_[to] += quadrics_[from];
+        // outdates all queued collapses of to
+        versions_[to]++;
+        for (const auto neighbor : get_neighbors(to)) {
+            push_collapse(to, neighbor);
+        }
+    }
+};
+
+vector<VertexIndex> simplify_triangles(const vector<Vertex>& vertices, const vector<VertexIndex>& triangles, size_t target_triangles_count, float max_error)
+{
+    assert(triangles.size() % 3 == 0);
+    if (triangles.size() / 3 <= target_triangles_count) {
+        return triangles;
+    }
+    auto simplifier = Simplifier{ vertices, triangles };
+    return simplifier.run(target_triangles_count, max_error);
+}
+
+void make_lod_chain(MeshData& mesh, const vector<float>& ratios, unsigned int threads_count)
+{
+    assert(mesh.primitive == Primitive::triangles);
+    const size_t triangles_count = mesh.indices.size() / 3;
+
+    auto levels = vector<vector<VertexIndex>>(ratios.size());
+    parallel_for(ratios.size(), threads_count, [&](size_t i) {
+        if (ratios[i] >= 1.0f) {
+            levels[i] = mesh.indices;
+            return;
+        }
+        levels[i] = simplify_triangles(mesh.vertices, mesh.indices, triangles_count * ratios[i]);
+        // collapses scatter triangles
+        levels[i] = optimize_vertex_cache(levels[i], mesh.vertices.size());
+    });
+
+    mesh.indices.clear();
+    mesh.lods.clear();
+    for (const auto& level : levels) {
+        mesh.lods.push_back({ mesh.indices.size(), level.size() });
+        mesh.indices.insert(mesh.indices.end(), level.begin(), level.end());
+    }
+}
+}
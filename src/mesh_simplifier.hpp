@@ -0,0 +1,29 @@
+#pragma once
+#include "geometry.hpp"
+#include <limits>
+#include <vector>
+
+namespace lindenmaker {
+
+/** Fractions of triangles kept at each level of detail, finest first */
+const auto DEFAULT_LOD_RATIOS = std::vector<float>{ 1.0f, 0.5f, 0.25f, 0.1f };
+
+/**
+ * Triangle list with at most target_triangles_count triangles (if reachable) approximating triangles,
+ * by collapsing edges onto one of their vertices in order of quadric error (Garland and Heckbert).
+ * Returned triangles reuse vertices as they are, so that levels of detail can share them.
+ * Boundaries are kept in place and vertices of different colors never merge.
+ * No collapse goes above max_error, a sum of squared distances to planes of original triangles.
+ */
+std::vector<VertexIndex> simplify_triangles(
+    const std::vector<Vertex>& vertices,
+    const std::vector<VertexIndex>& triangles,
+    std::size_t target_triangles_count,
+    float max_error = std::numeric_limits<float>::max());
+
+/**
+ * Replaces indices of a triangle list mesh by one level of detail per ratio, one after the other,
+ * their ranges being in mesh.lods. Levels are simplified from the original mesh concurrently.
+ */
+void make_lod_chain(MeshData& mesh, const std::vector<float>& ratios = DEFAULT_LOD_RATIOS, unsigned int threads_count = 1);
+}
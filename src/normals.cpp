@@ -0,0 +1,167 @@
+#include "normals.hpp"
+#include "lanes.hpp"
+#include "parallel.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <numeric>
+
+namespace lindenmaker {
+
+using std::size_t;
+using std::vector;
+
+// smaller meshes are not worth threads
+const size_t MIN_PARALLEL_TRIANGLES = 1 << 16;
+// work items of parallel loops
+const size_t CHUNK_SIZE = 4096;
+
+// Structure of arrays, one entry per vertex or per face
+
+struct Positions
+{
+    vector<float> x, y, z;
+};
+
+struct FaceNormals
+{
+    vector<float> x, y, z;
+    // per corner
+    vector<float> weights;
+};
+
+static LaneVector subtract(const LaneVector& a, const LaneVector& b)
+{
+    return { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+static LaneVector cross(const LaneVector& a, const LaneVector& b)
+{
+    return {
+        a.y * b.z - b.y * a.z,
+        a.z * b.x - b.z * a.x,
+        a.x * b.y - b.x * a.y
+    };
+}
+
+static Lanes dot(const LaneVector& a, const LaneVector& b)
+{
+    return a.x * b.x + a.y * b.y + a.z * b.z;
+}
+
+// faces [begin, begin + LANES_COUNT), unused lanes repeating the last face
+static void compute_face_normals(const Positions& positions, const vector<VertexIndex>& triangles, size_t begin, NormalsWeighting weighting, FaceNormals& normals)
+{
+    const size_t faces_count = triangles.size() / 3;
+    const size_t lanes_count = std::min(LANES_COUNT, faces_count - begin);
+
+    auto corners = std::array<LaneVector, 3>{};
+    for (size_t lane = 0; lane < LANES_COUNT; lane++) {
+        const size_t face = begin + std::min(lane, lanes_count - 1);
+        for (size_t i = 0; i < 3; i++) {
+            const auto index = triangles[face * 3 + i];
+            corners[i].x[lane] = positions.x[index];
+            corners[i].y[lane] = positions.y[index];
+            corners[i].z[lane] = positions.z[index];
+        }
+    }
+
+    const auto delta_2_1 = subtract(corners[1], corners[0]);
+    const auto delta_3_1 = subtract(corners[2], corners[0]);
+    const auto delta_3_2 = subtract(corners[2], corners[1]);
+    auto normal = cross(delta_3_1, delta_2_1);
+    auto weights = std::array<Lanes, 3>{ broadcast(1.0f), broadcast(1.0f), broadcast(1.0f) };
+
+    if (weighting == NormalsWeighting::angle) {
+        // degenerate faces get a null normal
+        const auto normal_square = dot(normal, normal);
+        const auto is_degenerate = __builtin_convertvector(normal_square == 0.0f, Lanes);
+        const auto normal_scale = (1.0f + is_degenerate) / lane_sqrt(normal_square - is_degenerate);
+        normal = { normal.x * normal_scale, normal.y * normal_scale, normal.z * normal_scale };
+
+        const auto length_2_1 = lane_sqrt(dot(delta_2_1, delta_2_1) - is_degenerate);
+        const auto length_3_1 = lane_sqrt(dot(delta_3_1, delta_3_1) - is_degenerate);
+        const auto length_3_2 = lane_sqrt(dot(delta_3_2, delta_3_2) - is_degenerate);
+        weights[0] = fast_acos(dot(delta_2_1, delta_3_1) / (length_2_1 * length_3_1));
+        weights[1] = fast_acos(-dot(delta_2_1, delta_3_2) / (length_2_1 * length_3_2));
+        weights[2] = fast_acos(dot(delta_3_1, delta_3_2) / (length_3_1 * length_3_2));
+    }
+
+    for (size_t lane = 0; lane < lanes_count; lane++) {
+        const size_t face = begin + lane;
+        normals.x[face] = normal.x[lane];
+        normals.y[face] = normal.y[lane];
+        normals.z[face] = normal.z[lane];
+        for (size_t i = 0; i < 3; i++) {
+            normals.weights[face * 3 + i] = weights[i][lane];
+        }
+    }
+}
+
+/**
+ * Faces are processed LANES_COUNT at a time into structure of arrays normals, then each vertex
+ * gathers normals of its faces through a compressed vertex => corners adjacency, so that
+ * threads never write to the same vertex.
+ */
+void compute_vertex_normals(vector<Vertex>& vertices, const vector<VertexIndex>& triangles, NormalsWeighting weighting, unsigned int threads_count)
+{
+    assert(triangles.size() % 3 == 0);
+    const size_t faces_count = triangles.size() / 3;
+    if (faces_count < MIN_PARALLEL_TRIANGLES) {
+        threads_count = 1;
+    }
+    const auto chunks_count = [](size_t count) { return (count + CHUNK_SIZE - 1) / CHUNK_SIZE; };
+
+    auto positions = Positions{};
+    positions.x.resize(vertices.size());
+    positions.y.resize(vertices.size());
+    positions.z.resize(vertices.size());
+    parallel_for(chunks_count(vertices.size()), threads_count, [&](size_t chunk) {
+        const size_t end = std::min((chunk + 1) * CHUNK_SIZE, vertices.size());
+        for (size_t i = chunk * CHUNK_SIZE; i < end; i++) {
+            positions.x[i] = vertices[i].position.x;
+            positions.y[i] = vertices[i].position.y;
+            positions.z[i] = vertices[i].position.z;
+        }
+    });
+
+    auto face_normals = FaceNormals{};
+    face_normals.x.resize(faces_count);
+    face_normals.y.resize(faces_count);
+    face_normals.z.resize(faces_count);
+    face_normals.weights.resize(triangles.size());
+    // chunks are a multiple of lanes
+    parallel_for(chunks_count(faces_count), threads_count, [&](size_t chunk) {
+        const size_t end = std::min((chunk + 1) * CHUNK_SIZE, faces_count);
+        for (size_t begin = chunk * CHUNK_SIZE; begin < end; begin += LANES_COUNT) {
+            compute_face_normals(positions, triangles, begin, weighting, face_normals);
+        }
+    });
+
+    // vertex => corners, corner being face * 3 + index in face
+    auto corner_offsets = vector<size_t>(vertices.size() + 1);
+    for (const auto index : triangles) {
+        corner_offsets[index + 1]++;
+    }
+    std::partial_sum(corner_offsets.begin(), corner_offsets.end(), corner_offsets.begin());
+    auto corners = vector<size_t>(triangles.size());
+    auto cursors = vector<size_t>(corner_offsets.begin(), corner_offsets.end() - 1);
+    for (size_t corner = 0; corner < triangles.size(); corner++) {
+        corners[cursors[triangles[corner]]++] = corner;
+    }
+
+    parallel_for(chunks_count(vertices.size()), threads_count, [&](size_t chunk) {
+        const size_t end = std::min((chunk + 1) * CHUNK_SIZE, vertices.size());
+        for (size_t i = chunk * CHUNK_SIZE; i < end; i++) {
+            auto normal = glm::vec3{ 0.0f };
+            for (size_t j = corner_offsets[i]; j < corner_offsets[i + 1]; j++) {
+                const size_t face = corners[j] / 3;
+                const auto face_normal = glm::vec3{ face_normals.x[face], face_normals.y[face], face_normals.z[face] };
+                normal += face_normal * face_normals.weights[corners[j]];
+            }
+            const float length = glm::length(normal);
+            vertices[i].normal = length != 0.0f ? normal / length : normal;
+        }
+    });
+}
+}
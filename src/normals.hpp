@@ -0,0 +1,25 @@
+#pragma once
+#include "geometry.hpp"
+#include <vector>
+
+namespace lindenmaker {
+
+enum class NormalsWeighting
+{
+    // by face angle at each vertex, for normals independent of tessellation
+    angle,
+    // by face area, cheaper
+    area
+};
+
+/**
+ * Sets normals of vertices to the weighted average of the normals of triangles around them,
+ * triangles being listed three indices at a time. Normals face away from front faces,
+ * which shaders expect, and are left null for vertices of degenerate triangles only.
+ */
+void compute_vertex_normals(
+    std::vector<Vertex>& vertices,
+    const std::vector<VertexIndex>& triangles,
+    NormalsWeighting weighting = NormalsWeighting::angle,
+    unsigned int threads_count = 1);
+}
@@ -0,0 +1,198 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+namespace lindenmaker {
+
+/** Number of worker threads to use when none is specified */
+inline unsigned int get_default_threads_count()
+{
+    return std::max(std::thread::hardware_concurrency(), 1u);
+}
+
+/** Calls fn(i) for i in [0, count), dynamically spread over threads_count threads */
+template <typename F>
+void parallel_for(std::size_t count, unsigned int threads_count, F fn)
+{
+    threads_count = std::min<std::size_t>(threads_count, count);
+    if (threads_count <= 1) {
+        for (std::size_t i = 0; i < count; i++) {
+            fn(i);
+        }
+        return;
+    }
+
+    auto next_index = std::atomic<std::size_t>{ 0 };
+    auto work = [&]() {
+        for (auto i = next_index++; i < count; i = next_index++) {
+            fn(i);
+        }
+    };
+
+    auto threads = std::vector<std::thread>{};
+    for (unsigned int i = 1; i < threads_count; i++) {
+        threads.emplace_back(work);
+    }
+    // calling thread takes its share too
+    work();
+
+    for (auto& thread : threads) {
+        thread.join();
+    }
+}
+
+/** Number of contiguous chunks parallel_for_chunks() splits count elements into */
+inline std::size_t get_chunks_count(std::size_t count, unsigned int threads_count)
+{
+    threads_count = std::max(threads_count, 1u);
+    const std::size_t chunk_size = (count + threads_count - 1) / threads_count;
+    return chunk_size == 0 ? 0 : (count + chunk_size - 1) / chunk_size;
+}
+
+/**
+ * Calls fn(chunk, begin, end) on contiguous chunks covering [0, count), one per thread,
+ * for loops whose iterations are too cheap to be handed out one at a time
+ */
+template <typename F>
+void parallel_for_chunks(std::size_t count, unsigned int threads_count, F fn)
+{
+    threads_count = std::max(threads_count, 1u);
+    const std::size_t chunk_size = (count + threads_count - 1) / threads_count;
+    parallel_for(get_chunks_count(count, threads_count), threads_count, [&](std::size_t chunk) {
+        const std::size_t begin = chunk * chunk_size;
+        fn(chunk, begin, std::min(begin + chunk_size, count));
+    });
+}
+
+/** In place inclusive scan, op only needs to be associative */
+template <typename T, typename Op>
+void parallel_inclusive_scan(std::vector<T>& values, Op op, unsigned int threads_count)
+{
+    const std::size_t chunks_count = get_chunks_count(values.size(), threads_count);
+    auto lasts = std::vector<T>(chunks_count);
+    parallel_for_chunks(values.size(), threads_count, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin + 1; i < end; i++) {
+            values[i] = op(values[i - 1], values[i]);
+        }
+        lasts[chunk] = values[end - 1];
+    });
+
+    for (std::size_t chunk = 1; chunk < chunks_count; chunk++) {
+        lasts[chunk] = op(lasts[chunk - 1], lasts[chunk]);
+    }
+
+    parallel_for_chunks(values.size(), threads_count, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+        if (chunk == 0) {
+            return;
+        }
+        for (std::size_t i = begin; i < end; i++) {
+            values[i] = op(lasts[chunk - 1], values[i]);
+        }
+    });
+}
+
+/**
+ * Indices of keys by increasing key, equal keys keeping their order.
+ * Radix sort on 8 bit digits, each pass scattering chunks concurrently.
+ */
+inline std::vector<std::uint32_t> parallel_stable_sort_indices(const std::vector<std::uint32_t>& keys, unsigned int threads_count)
+{
+    const std::size_t count = keys.size();
+    auto order = std::vector<std::uint32_t>(count);
+    parallel_for_chunks(count, threads_count, [&](std::size_t, std::size_t begin, std::size_t end) {
+        for (std::size_t i = begin; i < end; i++) {
+            order[i] = i;
+        }
+    });
+
+    const std::size_t chunks_count = get_chunks_count(count, threads_count);
+    auto max_keys = std::vector<std::uint32_t>(chunks_count, 0);
+    parallel_for_chunks(count, threads_count, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+        max_keys[chunk] = *std::max_element(keys.begin() + begin, keys.begin() + end);
+    });
+    const std::uint32_t max_key = chunks_count > 0 ? *std::max_element(max_keys.begin(), max_keys.end()) : 0;
+
+    const std::size_t DIGITS_COUNT = 256;
+    auto sorted = std::vector<std::uint32_t>(count);
+    // first index of each digit in each chunk
+    auto offsets = std::vector<std::size_t>(chunks_count * DIGITS_COUNT);
+    for (unsigned int shift = 0; shift < 32 && (max_key >> shift) > 0; shift += 8) {
+        auto get_digit = [&](std::uint32_t index) { return (keys[index] >> shift) & (DIGITS_COUNT - 1); };
+
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallel_for_chunks(count, threads_count, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; i++) {
+                offsets[chunk * DIGITS_COUNT + get_digit(order[i])]++;
+            }
+        });
+        std::size_t offset = 0;
+        for (std::size_t digit = 0; digit < DIGITS_COUNT; digit++) {
+            for (std::size_t chunk = 0; chunk < chunks_count; chunk++) {
+                const auto digit_count = offsets[chunk * DIGITS_COUNT + digit];
+                offsets[chunk * DIGITS_COUNT + digit] = offset;
+                offset += digit_count;
+            }
+        }
+
+        parallel_for_chunks(count, threads_count, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+            for (std::size_t i = begin; i < end; i++) {
+                sorted[offsets[chunk * DIGITS_COUNT + get_digit(order[i])]++] = order[i];
+            }
+        });
+        order.swap(sorted);
+    }
+    return order;
+}
+
+/**
+ * In place inclusive scan restarting at every head, op only needs to be associative.
+ * Chunks are scanned concurrently, then fixed up with the value carried from previous chunks.
+ */
+template <typename T, typename Op>
+void parallel_segmented_inclusive_scan(std::vector<T>& values, const std::vector<unsigned char>& heads, Op op, unsigned int threads_count)
+{
+    const std::size_t count = values.size();
+    if (count == 0) {
+        return;
+    }
+    threads_count = std::max(threads_count, 1u);
+    const std::size_t chunk_size = (count + threads_count - 1) / threads_count;
+    const std::size_t chunks_count = get_chunks_count(count, threads_count);
+
+    auto chunk_has_head = std::vector<unsigned char>(chunks_count);
+    parallel_for_chunks(count, threads_count, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+        bool has_head = heads[begin];
+        for (std::size_t i = begin + 1; i < end; i++) {
+            if (heads[i]) {
+                has_head = true;
+            } else {
+                values[i] = op(values[i - 1], values[i]);
+            }
+        }
+        chunk_has_head[chunk] = has_head;
+    });
+
+    // value to prepend to the elements before the first head of each chunk
+    auto carries = std::vector<T>(chunks_count);
+    auto has_carry = std::vector<unsigned char>(chunks_count);
+    for (std::size_t chunk = 1; chunk < chunks_count; chunk++) {
+        const auto& last = values[chunk * chunk_size - 1];
+        const bool extends_carry = has_carry[chunk - 1] && !chunk_has_head[chunk - 1];
+        carries[chunk] = extends_carry ? op(carries[chunk - 1], last) : last;
+        has_carry[chunk] = !heads[chunk * chunk_size];
+    }
+
+    parallel_for_chunks(count, threads_count, [&](std::size_t chunk, std::size_t begin, std::size_t end) {
+        if (!has_carry[chunk]) {
+            return;
+        }
+        for (std::size_t i = begin; i < end && !heads[i]; i++) {
+            values[i] = op(carries[chunk], values[i]);
+        }
+    });
+}
+}
@@ -4,16 +4,88 @@
 #include "geometry.hpp"
 #include "glad.hpp"
 #include "lsystem.hpp"
+#include "mesh_optimizer.hpp"
+#include "mesh_simplifier.hpp"
+#include "parallel.hpp"
+#include "tree_mesh.hpp"
+#include "turtle.hpp"
+#include <algorithm>
+#include <cassert>
 #include <cstdlib>
+#include <limits>
+#include <memory>
 #include <stack>
+#include <utility>
 #include <vector>
 
 namespace lindenmaker {
 
+using std::size_t;
 using std::stack;
 using std::string;
 using std::vector;
 
+// thinner branches are replaced by a leaf
+const float MIN_BRANCH_RADIUS = 0.01f;
+const unsigned int FUSED_RINGS_PER_SEGMENT = 3;
+// tube tessellation
+const unsigned int MAX_TUBE_SEGMENTS = 15;
+const float MAX_TUBE_ERROR = 0.01f;
+const unsigned int MIN_RADIAL_SEGMENTS = 3;
+const float TARGET_RADIAL_EDGE_LENGTH = 0.1f;
+// branch points simplification
+const float MIN_POINT_DISTANCE = 0.05f;
+const float MAX_POINT_DEVIATION = 0.005f;
+// repeated subtrees drawn as instances
+const size_t MIN_INSTANCED_SUBTREE_SIZE = 64;
+const float SUBTREE_SIZE_TOLERANCE = 0.05f;
+const float SUBTREE_RADIUS_TOLERANCE = 0.005f;
+// smallest tree scale at which each level of detail but the coarsest is drawn
+const auto LOD_MIN_SCALES = std::vector<float>{ 0.5f, 0.25f, 0.1f };
+
+static glm::quat get_rotation(const Instance& instance)
+{
+    return glm::quat{ instance.rotation.w, instance.rotation.x, instance.rotation.y, instance.rotation.z };
+}
+
+// same transform as in vertex shaders
+static glm::vec3 transform_point(const Instance& instance, const glm::vec3& point)
+{
+    return glm::vec3{ instance.offset_scale } + get_rotation(instance) * (instance.offset_scale.w * point);
+}
+
+/** Child instance placed in the space of parent */
+static Instance compose_instances(const Instance& parent, const Instance& child)
+{
+    return Instance{
+        transform_point(parent, glm::vec3{ child.offset_scale }),
+        parent.offset_scale.w * child.offset_scale.w,
+        get_rotation(parent) * get_rotation(child)
+    };
+}
+
+// walked branch starting a chain of its own
+const size_t NO_CHAIN = std::numeric_limits<size_t>::max();
+
+/** Branch meshed as a tube */
+struct TubeBranch
+{
+    Branch* branch;
+    unsigned int depth;
+    unsigned int radial_segments_count;
+    bool should_draw_start_cap;
+    bool should_draw_end_cap;
+};
+
+/** Branch waiting to be walked, with the chain of tubes it goes on from if any */
+struct WalkedBranch
+{
+    Branch* branch;
+    unsigned int depth;
+    size_t chain;
+    bool should_draw_start_cap;
+};
+
 static float rand_float_in(float min, float max)
 {
     return min + ((float) rand() / (float) RAND_MAX) * (max - min);
@@ -24,6 +96,13 @@ static int rand_int_in(int min, int max)
     return std::round(min + ((float) rand() / (float) RAND_MAX) * (max - min));
 }
 
+// thin branches get fewer sides
+static unsigned int get_radial_segments_count(float radius, unsigned int max_count)
+{
+    const auto count = (unsigned int) std::ceil(2.0f * M_PI * radius / TARGET_RADIAL_EDGE_LENGTH);
+    return std::max(MIN_RADIAL_SEGMENTS, std::min(count, max_count));
+}
+
 Scene::Scene()
 {
     gen_tree();
@@ -52,67 +131,221 @@ void Scene::gen_tree()
     float leaf_scale_multiplicator = rand_float_in(0.0f, 2.0f * 6.0f / derivations_count);
 
     string sentence = lsystem.derive(derivations_count);
-    auto tree = sentence_to_tree(sentence, angle, step_length, radius, length_decay, radius_decay);
-    auto branches = stack<Branch>{};
-    branches.push(tree);
+    auto pruning = PruningCriteria{};
+    pruning.min_radius = MIN_BRANCH_RADIUS;
 
     float min_y = 9999.0f, max_y = -9999.0f;
 
     auto brown = glm::vec3{ 54.0f / 255.0f, 43.0f / 255.0f, 20.0f / 255.0f };
     auto green = glm::vec3{ 43.0f / 255.0f, 79.0f / 255.0f, 14.0f / 255.0f };
-    auto icosahedron = make_icosahedron(1.0f, green);
+    // leaves are instances of a single icosahedron, drawn at once
+    auto leaves = std::make_shared<Geometry>(make_icosahedron(1.0f, green, uses_vertex_normals_));
+    auto leaf_instances = vector<Instance>{};
 
     auto new_tree_object = CompositeObject<GeometryObject>{};
 
-    unsigned int branch_counter = 0;
-    while (!branches.empty()) {
-        auto branch = branches.top();
-        branches.pop();
-        branch_counter++;
+    auto add_leaf = [&](vector<Instance>& instances, const glm::vec3& position, float radius) {
+        // randomized leaf size
+        float min_scale = radius * 1.5;
+        float scale = min_scale + min_scale * rand_float_in(0.0f, leaf_scale_multiplicator);
 
-        // can happen with weird l systems rules
-        if (branch.points.size() < 2) {
-            for (auto& fork : branch.forks) {
-                branches.push(fork);
+        // random leaf orientation
+        float x_angle = ((float) rand() / (float) RAND_MAX) * 2.0f * M_PI;
+        float y_angle = ((float) rand() / (float) RAND_MAX) * 2.0f * M_PI;
+        float z_angle = ((float) rand() / (float) RAND_MAX) * 2.0f * M_PI;
+        const auto rotation = glm::angleAxis(x_angle, glm::vec3{ 1.0f, 0.0f, 0.0f })
+            * glm::angleAxis(y_angle, glm::vec3{ 0.0f, 1.0f, 0.0f })
+            * glm::angleAxis(z_angle, glm::vec3{ 0.0f, 0.0f, 1.0f });
+
+        instances.emplace_back(position, scale, rotation);
+    };
+
+    tree_geometries_.clear();
+    tree_optimization_stats_ = MeshOptimizationStats{};
+    // tubes drawn once, or at each instance if any
+    auto add_tubes = [&](MeshData& mesh, const vector<Instance>& instances) {
+        if (mesh.vertices.empty()) {
+            return;
+        }
+        auto bounds = mesh.bounds;
+        if (!instances.empty()) {
+            bounds = Bounds{};
+            for (const auto& instance : instances) {
+                for (unsigned int corner = 0; corner < 8; corner++) {
+                    bounds.add(transform_point(instance, glm::vec3{
+                        corner & 1 ? mesh.bounds.max.x : mesh.bounds.min.x,
+                        corner & 2 ? mesh.bounds.max.y : mesh.bounds.min.y,
+                        corner & 4 ? mesh.bounds.max.z : mesh.bounds.min.z }));
+                }
             }
-            continue;
         }
+        min_y = std::min(min_y, bounds.min.y);
+        max_y = std::max(max_y, bounds.max.y);
 
-        for (const auto& point : branch.points) {
-            min_y = std::min(min_y, point.y);
-            max_y = std::max(max_y, point.y);
+        make_lod_chain(mesh, DEFAULT_LOD_RATIOS, get_default_threads_count());
+        auto geometry = std::make_shared<Geometry>(mesh);
+        if (!instances.empty()) {
+            geometry->set_instances(instances);
         }
+        tree_geometries_.push_back(geometry);
+        new_tree_object.add_object(GeometryObject{ geometry });
+    };
 
-        auto curve = CatmullRomCurve(branch.points);
+    // tubes of branches down from root, which is at root_depth in the whole tree, leaves going to leaves
+    auto mesh_branches = [&](Branch& root, unsigned int root_depth, vector<Instance>& leaves) {
+        auto branches = stack<WalkedBranch>{};
+        branches.push({ &root, root_depth, NO_CHAIN, true });
 
-        auto tube_object = GeometryObject{ make_tube(curve, 15, radial_segments_count, branch.radius_begin, branch.radius_end, true, brown) };
-        new_tree_object.add_object(tube_object);
+        // branches getting a tube, by chains meshed at once, leaves are added during the walk to keep rand() calls in order
+        auto chains = vector<vector<TubeBranch>>{};
+        unsigned int branch_counter = 0;
+        while (!branches.empty()) {
+            const auto walked = branches.top();
+            const auto branch = walked.branch;
+            branches.pop();
+            branch_counter++;
 
-        auto leaf_object = GeometryObject{ icosahedron };
-        leaf_object.transform.translate(curve.get_point(1.0f));
+            // twigs too small to be worth a tube
+            if (branch->is_pruned) {
+                add_leaf(leaves, branch->points.front(), branch->radius_end);
+                continue;
+            }
 
-        // randomized leaf size
-        float min_scale = branch.radius_end * 1.5;
-        float scale = min_scale + min_scale * rand_float_in(0.0f, leaf_scale_multiplicator);
-        leaf_object.transform.scale(glm::vec3{ scale });
+            // can happen with weird l systems rules
+            if (branch->points.size() < 2) {
+                for (auto& fork : branch->forks) {
+                    branches.push({ &fork, walked.depth + 1, NO_CHAIN, true });
+                }
+                continue;
+            }
 
-        // random leaf orientation
-        float x_angle = ((float) rand() / (float) RAND_MAX) * 2.0f * M_PI;
-        float y_angle = ((float) rand() / (float) RAND_MAX) * 2.0f * M_PI;
-        float z_angle = ((float) rand() / (float) RAND_MAX) * 2.0f * M_PI;
-        leaf_object.transform.rotate(Axis::x, x_angle);
-        leaf_object.transform.rotate(Axis::y, y_angle);
-        leaf_object.transform.rotate(Axis::z, z_angle);
+            // a branch going on from the end of a chain shares its last ring, so it has as many sides
+            auto chain = walked.chain;
+            auto branch_radial_segments_count = get_radial_segments_count(branch->radius_begin, radial_segments_count);
+            if (chain == NO_CHAIN) {
+                chain = chains.size();
+                chains.emplace_back();
+            } else {
+                branch_radial_segments_count = chains[chain].back().radial_segments_count;
+            }
+            chains[chain].push_back({ branch, walked.depth, branch_radial_segments_count, walked.should_draw_start_cap, true });
+
+            if (branch_counter > 0) {
+                add_leaf(leaves, branch->points.back(), branch->radius_end);
+            }
+
+            // first fork with a tube starting at the end of the branch, which then needs no end cap
+            Branch* continuation = nullptr;
+            if (use_shared_joints_) {
+                for (auto& fork : branch->forks) {
+                    if (!fork.is_pruned && fork.points.size() >= 2 && fork.points.front() == branch->points.back()) {
+                        continuation = &fork;
+                        chains[chain].back().should_draw_end_cap = false;
+                        break;
+                    }
+                }
+            }
+
+            for (auto& fork : branch->forks) {
+                if (&fork == continuation) {
+                    branches.push({ &fork, walked.depth + 1, chain, false });
+                    continue;
+                }
+                // start cap is inside the branch unless the fork starts less than its radius away from either end
+                const auto& start = fork.points.front();
+                const bool is_cap_hidden = use_shared_joints_
+                    && glm::distance(start, branch->points.front()) >= fork.radius_begin
+                    && glm::distance(start, branch->points.back()) >= fork.radius_begin;
+                branches.push({ &fork, walked.depth + 1, NO_CHAIN, !is_cap_hidden });
+            }
+        }
+
+        // tubes don't need GL, so chains are meshed concurrently and only uploaded once merged
+        auto tubes = vector<MeshData>(chains.size());
+        auto tubes_stats = vector<MeshOptimizationStats>(chains.size());
+        parallel_for(chains.size(), get_default_threads_count(), [&](size_t i) {
+            auto& mesh = tubes[i];
+            mesh.primitive = Primitive::triangle_strip;
+            auto end = TubeEnd{};
 
-        if (branch_counter > 0) {
-            new_tree_object.add_object(leaf_object);
+            for (size_t j = 0; j < chains[i].size(); j++) {
+                const auto& tube = chains[i][j];
+                const auto branch = tube.branch;
+
+                // curve and tube costs follow geometric detail rather than symbols count
+                auto& points = branch->points;
+                points.resize(simplify_points(points.data(), points.size(), MIN_POINT_DISTANCE, MAX_POINT_DEVIATION));
+
+                const auto kernel = curve_kernels_[std::min<size_t>(tube.depth, curve_kernels_.size() - 1)];
+                const auto curve = make_curve(kernel, points.data(), points.size());
+
+                // polylines, and curves through 2 points which are straight, only need a ring at each point
+                auto xs = vector<float>{};
+                if (kernel == CurveKernel::polyline || points.size() == 2) {
+                    for (size_t k = 0; k < points.size(); k++) {
+                        xs.push_back((float) k / (float) (points.size() - 1));
+                    }
+                } else {
+                    xs = get_adaptive_samples(*curve, MAX_TUBE_ERROR, MAX_TUBE_SEGMENTS);
+                }
+
+                // all curves go through the last point, where the next tube starts
+                end = append_tube(mesh, *curve, xs, tube.radial_segments_count, branch->radius_begin, branch->radius_end,
+                    j > 0 ? &end : nullptr, tube.should_draw_start_cap, tube.should_draw_end_cap, brown);
+            }
+            mesh.bounds = compute_bounds(mesh.vertices);
+            tubes_stats[i] = optimize_mesh(mesh);
+        });
+        for (const auto& stats : tubes_stats) {
+            tree_optimization_stats_ += stats;
         }
 
-        for (auto& fork : branch.forks) {
-            branches.push(fork);
+        // drawn at once
+        return merge_meshes(tubes);
+    };
+
+    if (use_fused_meshing_) {
+        auto parameters = TurtleParameters{ angle, step_length, radius, length_decay, radius_decay };
+        auto tree_mesh = sentence_to_mesh(sentence, parameters, pruning, FUSED_RINGS_PER_SEGMENT, radial_segments_count, brown, use_shared_joints_);
+
+        tree_optimization_stats_ += optimize_mesh(tree_mesh.mesh);
+        add_tubes(tree_mesh.mesh, {});
+        for (const auto& leaf : tree_mesh.leaves) {
+            add_leaf(leaf_instances, leaf.position, leaf.radius);
+        }
+    } else {
+        // repeated subtrees are cut out of the sentence, meshed once and drawn at each occurrence,
+        // curve sampling and tessellation being those of the first occurrence, and leaves its leaves scaled
+        const auto interpreter = TurtleInterpreter(sentence, angle, step_length, radius, length_decay, radius_decay, pruning);
+        const auto repeats = interpreter.find_repeated_subtrees(MIN_INSTANCED_SUBTREE_SIZE, SUBTREE_SIZE_TOLERANCE, SUBTREE_RADIUS_TOLERANCE);
+
+        auto tree = sentence_to_tree_parallel(repeats.sentence, angle, step_length, radius, length_decay, radius_decay, get_default_threads_count(), pruning);
+        auto tree_tubes = mesh_branches(tree, 0, leaf_instances);
+        add_tubes(tree_tubes, {});
+
+        for (const auto& subtree : repeats.subtrees) {
+            // canonical subtree, built at the origin from the first occurrence
+            const auto& first = subtree.turtles.front();
+            auto root = TurtleInterpreter(subtree.sentence, angle, first.step_length, first.radius, first.length_decay, first.radius_decay, pruning).run();
+            auto subtree_leaves = vector<Instance>{};
+            auto subtree_tubes = mesh_branches(root, subtree.depth, subtree_leaves);
+
+            auto instances = vector<Instance>{};
+            for (const auto& turtle : subtree.turtles) {
+                instances.emplace_back(turtle.position, turtle.step_length / first.step_length, turtle.orientation);
+                for (const auto& leaf : subtree_leaves) {
+                    leaf_instances.push_back(compose_instances(instances.back(), leaf));
+                }
+            }
+            add_tubes(subtree_tubes, instances);
         }
     }
 
+    if (!leaf_instances.empty()) {
+        leaves->set_instances(leaf_instances);
+        new_tree_object.add_object(GeometryObject{ leaves });
+    }
+
     // Center tree vertically
     float center_y = (max_y - min_y) / 2.0f;
     new_tree_object.transform.translate(Axis::y, -center_y);
@@ -123,6 +356,22 @@ void Scene::gen_tree()
     tree_object_ = new_tree_object;
 }
 
+void Scene::set_fused_meshing(bool is_enabled)
+{
+    use_fused_meshing_ = is_enabled;
+}
+
+void Scene::set_shared_joints(bool is_enabled)
+{
+    use_shared_joints_ = is_enabled;
+}
+
+void Scene::set_curve_kernels(vector<CurveKernel> kernels)
+{
+    assert(!kernels.empty());
+    curve_kernels_ = std::move(kernels);
+}
+
 void Scene::set_tree_rotation(float x_amount, float y_amount)
 {
     tree_rotation_ = glm::mat4{ 1.0 };
@@ -133,6 +382,14 @@ void Scene::set_tree_rotation(float x_amount, float y_amount)
 void Scene::set_tree_scale(float amount)
 {
     tree_scale_ = glm::scale(glm::mat4{ 1.0 }, glm::vec3{ amount });
+
+    // smaller trees get coarser branches
+    const auto lod = std::count_if(LOD_MIN_SCALES.begin(), LOD_MIN_SCALES.end(), [&](float min_scale) {
+        return amount < min_scale;
+    });
+    for (const auto& geometry : tree_geometries_) {
+        geometry->set_lod(lod);
+    }
 }
 
 void Scene::draw(const Camera& camera) const
@@ -6,6 +6,10 @@
 #include <glm/glm.hpp>
 
 #include "branch.hpp"
+#include "curve.hpp"
+#include "mesh_optimizer.hpp"
+#include <memory>
+#include <vector>
 
 namespace lindenmaker {
 
@@ -14,16 +18,34 @@ class Scene
 public:
     Scene();
     void gen_tree();
+    /** Build tree meshes straight from the sentence, without Branch tree */
+    void set_fused_meshing(bool is_enabled);
+    bool is_fused_meshing() const { return use_fused_meshing_; }
+    /** Forks going on from the end of their parent reuse its last ring, and caps hidden inside parents are skipped */
+    void set_shared_joints(bool is_enabled);
+    bool has_shared_joints() const { return use_shared_joints_; }
+    /** Curve kernel of branches at each depth, the last one being used for deeper branches too */
+    void set_curve_kernels(std::vector<CurveKernel> kernels);
     void set_tree_rotation(float x_amount, float y_amount);
     void set_tree_scale(float amount);
     void draw(const Camera& camera) const;
+    /** Of all tubes of the last tree generated, instanced ones counted once */
+    const MeshOptimizationStats& get_optimization_stats() const { return tree_optimization_stats_; }
 
 private:
     // ShaderProgram program_ = ShaderProgram{ "phong.vs", "phong.fs" };
     ShaderProgram program_ = ShaderProgram{ "flat.vs", "flat.gs", "flat.fs" };
+    // flat shading computes face normals in its geometry shader
+    bool uses_vertex_normals_ = false;
     glm::vec3 light_position_ = glm::vec3{ 5.0f, 3.0f, 0.0f };
     CompositeObject<GeometryObject> tree_object_;
+    // branches of the tree and of its repeated subtrees, which have levels of detail
+    std::vector<std::shared_ptr<Geometry>> tree_geometries_;
     glm::mat4 tree_scale_ = glm::mat4{ 1.0 };
     glm::mat4 tree_rotation_ = glm::mat4{ 1.0 };
+    bool use_fused_meshing_ = false;
+    bool use_shared_joints_ = true;
+    MeshOptimizationStats tree_optimization_stats_;
+    std::vector<CurveKernel> curve_kernels_ = { CurveKernel::catmull_rom };
 };
 }
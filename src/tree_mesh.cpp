@@ -0,0 +1,230 @@
+#include "tree_mesh.hpp"
+#include "curve.hpp"
+#include "turtle.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+
+namespace lindenmaker {
+
+using std::size_t;
+using std::string_view;
+using std::vector;
+
+// Start cap of a fork, only drawn if it sticks out of its parent
+struct ForkCap
+{
+    VertexIndex ring;
+    glm::vec3 center;
+    glm::vec3 tangent;
+    float radius;
+};
+
+// Last points of a branch still being walked, most recent last
+struct OpenBranch
+{
+    glm::vec3 first_point;
+    std::array<glm::vec3, 4> points;
+    std::array<float, 4> radii;
+    size_t points_count = 0;
+    // first vertex, center and frame of last emitted ring
+    VertexIndex last_ring = 0;
+    glm::vec3 last_ring_point;
+    Frame frame;
+    bool has_ring = false;
+    // caps of forks which may be hidden, known once the branch ends
+    vector<ForkCap> fork_caps;
+};
+
+/** Turtle visitor writing tubes straight into a TreeMesh */
+class TubeEmitter
+{
+public:
+    TubeEmitter(TreeMesh& tree_mesh, unsigned int rings_per_segment, unsigned int radial_segments_count, const glm::vec3& color, bool should_skip_hidden_caps)
+        : tree_mesh_(tree_mesh),
+          rings_per_segment_(rings_per_segment),
+          radial_segments_count_(radial_segments_count),
+          circle_(get_unit_circle(radial_segments_count)),
+          color_(color),
+          should_skip_hidden_caps_(should_skip_hidden_caps)
+    {
+    }
+
+    void begin_branch(const Turtle& turtle)
+    {
+        open_branches_.emplace_back().first_point = turtle.position;
+        add_point(turtle);
+    }
+
+    void add_point(const Turtle& turtle)
+    {
+        auto& branch = open_branches_.back();
+        std::rotate(branch.points.begin(), branch.points.begin() + 1, branch.points.end());
+        std::rotate(branch.radii.begin(), branch.radii.begin() + 1, branch.radii.end());
+        branch.points.back() = turtle.position;
+        branch.radii.back() = turtle.radius;
+        branch.points_count++;
+
+        // segment before previous point is now fully known
+        if (branch.points_count >= 3) {
+            const auto& points = branch.points;
+            const auto point_0 = branch.points_count == 3 ? 2.0f * points[1] - points[2] : points[0];
+            emit_segment(branch, point_0, points[1], points[2], points[3], branch.radii[1], branch.radii[2], false);
+        }
+    }
+
+    void add_pruned(const Turtle& turtle)
+    {
+        tree_mesh_.leaves.push_back({ turtle.position, turtle.radius });
+    }
+
+    void end_branch(const Turtle&)
+    {
+        auto& branch = open_branches_.back();
+
+        // can happen with weird l systems rules
+        if (branch.points_count >= 2) {
+            const auto& points = branch.points;
+            const auto point_0 = branch.points_count == 2 ? 2.0f * points[2] - points[3] : points[1];
+            const auto point_3 = 2.0f * points[3] - points[2];
+            emit_segment(branch, point_0, points[2], points[3], point_3, branch.radii[2], branch.radii[3], true);
+            emit_cap(branch.last_ring, points[3], branch.frame.tangent, true);
+            tree_mesh_.leaves.push_back({ points[3], branch.radii[3] });
+        }
+
+        // a fork cap is inside the branch unless the fork starts less than its radius away from either end
+        for (const auto& cap : branch.fork_caps) {
+            if (branch.points_count < 2 || glm::distance(cap.center, branch.points[3]) < cap.radius) {
+                emit_cap(cap.ring, cap.center, cap.tangent, false);
+            }
+        }
+
+        open_branches_.pop_back();
+    }
+
+private:
+    TreeMesh& tree_mesh_;
+    unsigned int rings_per_segment_;
+    unsigned int radial_segments_count_;
+    const UnitCircle& circle_;
+    glm::vec3 color_;
+    bool should_skip_hidden_caps_;
+    vector<OpenBranch> open_branches_;
+
+    void emit_segment(OpenBranch& branch, const glm::vec3& point_0, const glm::vec3& point_1, const glm::vec3& point_2, const glm::vec3& point_3, float radius_1, float radius_2, bool is_last)
+    {
+        const auto segment = make_centripedal_catmull_rom(point_0, point_1, point_2, point_3);
+        const unsigned int rings_count = rings_per_segment_ + (is_last ? 1 : 0);
+        for (unsigned int i = 0; i < rings_count; i++) {
+            const float x = (float) i / (float) rings_per_segment_;
+            const auto point = segment.get_point(x);
+            const auto tangent = segment.get_derivative(x);
+            branch.frame = branch.has_ring ? transport_frame(branch.frame, branch.last_ring_point, point, tangent) : make_frame(tangent);
+            branch.last_ring_point = point;
+
+            const float speed = glm::length(tangent);
+            const float radius_slope = speed != 0.0f ? (radius_2 - radius_1) / speed : 0.0f;
+
+            const VertexIndex ring = tree_mesh_.mesh.vertices.size();
+            append_ring(tree_mesh_.mesh.vertices, circle_, point, branch.frame, glm::mix(radius_1, radius_2, x), radius_slope, color_);
+
+            if (branch.has_ring) {
+                connect_rings(branch.last_ring, ring);
+            } else {
+                add_start_cap(ring, point, branch.frame.tangent, radius_1);
+            }
+            branch.last_ring = ring;
+            branch.has_ring = true;
+        }
+    }
+
+    // forks are still open, under their parent
+    void add_start_cap(VertexIndex ring, const glm::vec3& center, const glm::vec3& tangent, float radius)
+    {
+        if (should_skip_hidden_caps_ && open_branches_.size() >= 2) {
+            auto& parent = open_branches_[open_branches_.size() - 2];
+            if (glm::distance(center, parent.first_point) >= radius) {
+                parent.fork_caps.push_back({ ring, center, tangent, radius });
+                return;
+            }
+        }
+        emit_cap(ring, center, tangent, false);
+    }
+
+    // same winding as strips of make_tube()
+    void connect_rings(VertexIndex ring_before, VertexIndex ring)
+    {
+        auto& indices = tree_mesh_.mesh.indices;
+        for (unsigned int i = 0; i < radial_segments_count_; i++) {
+            const auto next = (i + 1) % radial_segments_count_;
+            indices.insert(indices.end(), { ring_before + i, ring + i, ring_before + next });
+            indices.insert(indices.end(), { ring_before + next, ring + i, ring + next });
+        }
+    }
+
+    // normal faces inwards like ring normals
+    void emit_cap(VertexIndex ring, const glm::vec3& center, const glm::vec3& tangent, bool is_end)
+    {
+        const VertexIndex center_index = tree_mesh_.mesh.vertices.size();
+        tree_mesh_.mesh.vertices.emplace_back(center, color_).normal = is_end ? -tangent : tangent;
+
+        auto& indices = tree_mesh_.mesh.indices;
+        for (unsigned int i = 0; i < radial_segments_count_; i++) {
+            const auto next = (i + 1) % radial_segments_count_;
+            if (is_end) {
+                indices.insert(indices.end(), { ring + i, center_index, ring + next });
+            } else {
+                indices.insert(indices.end(), { center_index, ring + i, ring + next });
+            }
+        }
+    }
+};
+
+TreeMesh sentence_to_mesh(
+    string_view sentence,
+    const TurtleParameters& parameters,
+    const PruningCriteria& pruning,
+    const unsigned int rings_per_segment,
+    const unsigned int radial_segments_count,
+    const glm::vec3& color,
+    bool should_skip_hidden_caps)
+{
+    auto interpreter = TurtleInterpreter{
+        sentence,
+        parameters.angle,
+        parameters.step_length,
+        parameters.radius,
+        parameters.length_decay,
+        parameters.radius_decay,
+        pruning
+    };
+
+    // upper bounds over what the visit walks: a branch has at most one point per run of rotations, plus both ends
+    const auto& symbols = get_symbol_table();
+    size_t rotations_count = 0;
+    size_t branches_count = 1;
+    size_t pruned_count = 0;
+    auto previous_command = Command::invalid;
+    auto count_symbol = [&](size_t position, bool is_pruned) {
+        const auto command = symbols[(unsigned char) sentence[position]].command;
+        rotations_count += command == Command::rotate && previous_command != Command::rotate;
+        branches_count += command == Command::push && !is_pruned;
+        pruned_count += is_pruned;
+        previous_command = command;
+    };
+    interpreter.visit_symbols(count_symbol);
+    const size_t segments_count = rotations_count + branches_count;
+    const size_t rings_count = segments_count * rings_per_segment + branches_count;
+
+    auto tree_mesh = TreeMesh{};
+    tree_mesh.mesh.vertices.reserve(rings_count * radial_segments_count + 2 * branches_count);
+    tree_mesh.mesh.indices.reserve((segments_count * rings_per_segment + branches_count) * 6 * radial_segments_count);
+    tree_mesh.leaves.reserve(branches_count + pruned_count);
+
+    auto emitter = TubeEmitter{ tree_mesh, rings_per_segment, radial_segments_count, color, should_skip_hidden_caps };
+    interpreter.visit(emitter);
+
+    tree_mesh.mesh.bounds = compute_bounds(tree_mesh.mesh.vertices);
+    return tree_mesh;
+}
+}
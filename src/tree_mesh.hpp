@@ -0,0 +1,37 @@
+#pragma once
+#include "branch.hpp"
+#include "geometry.hpp"
+#include <glm/glm.hpp>
+#include <string_view>
+#include <vector>
+
+namespace lindenmaker {
+
+struct Leaf
+{
+    glm::vec3 position;
+    float radius;
+};
+
+/** Tubes of a whole tree merged as a triangle list with normals, and where to put leaves */
+struct TreeMesh
+{
+    MeshData mesh;
+    std::vector<Leaf> leaves;
+};
+
+/**
+ * Fused path from sentence to mesh, without an intermediate Branch tree:
+ * tube rings are emitted while the turtle walks, each open branch only
+ * keeping the last few points needed to evaluate its spline.
+ * With should_skip_hidden_caps, forks get no start cap where it lies inside their parent.
+ */
+TreeMesh sentence_to_mesh(
+    std::string_view sentence,
+    const TurtleParameters& parameters,
+    const PruningCriteria& pruning,
+    unsigned int rings_per_segment,
+    unsigned int radial_segments_count,
+    const glm::vec3& color = glm::vec3{ 1.0f },
+    bool should_skip_hidden_caps = false);
+}
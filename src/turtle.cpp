@@ -0,0 +1,431 @@
+#include "turtle.hpp"
+#include "parallel.hpp"
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <map>
+#include <stack>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+
+namespace lindenmaker {
+
+using std::size_t;
+using std::stack;
+using std::string;
+using std::string_view;
+using std::vector;
+
+// below this size, subtrees are not worth their own task
+const size_t MIN_SUBTREE_TASK_SIZE = 4096;
+const size_t TASKS_PER_THREAD = 8;
+
+static SymbolTable make_symbol_table()
+{
+    auto table = SymbolTable{};
+
+    // forward alpha char
+    for (char symbol = 'A'; symbol <= 'Z'; symbol++) {
+        table[(unsigned char) symbol] = Symbol{ Command::forward };
+    }
+
+    // stack char
+    table['['] = Symbol{ Command::push };
+    table[']'] = Symbol{ Command::pop };
+
+    // rotation char: yaw, roll, pitch
+    const auto rotation_symbols = string_view{ "+-/\\^_" };
+    for (unsigned char i = 0; i < rotation_symbols.size(); i++) {
+        table[(unsigned char) rotation_symbols[i]] = Symbol{ Command::rotate, i };
+    }
+
+    return table;
+}
+
+const SymbolTable& get_symbol_table()
+{
+    static const auto table = make_symbol_table();
+    return table;
+}
+
+RotationTable make_rotation_table(float angle)
+{
+    return {
+        glm::quat(glm::vec3{ 0.0f, 0.0f, angle }), // + yaw
+        glm::quat(glm::vec3{ 0.0f, 0.0f, -angle }), // - yaw
+        glm::quat(glm::vec3{ 0.0f, angle, 0.0f }), // / roll
+        glm::quat(glm::vec3{ 0.0f, -angle, 0.0f }), // \ roll
+        glm::quat(glm::vec3{ angle, 0.0f, 0.0f }), // ^ pitch
+        glm::quat(glm::vec3{ -angle, 0.0f, 0.0f }) // _ pitch
+    };
+}
+
+void validate_sentence(string_view sentence)
+{
+    const auto& symbols = get_symbol_table();
+    for (const char symbol : sentence) {
+        if (symbols[(unsigned char) symbol].command == Command::invalid) {
+            throw std::runtime_error(string{ "Unknown symbol: " } + symbol);
+        }
+    }
+}
+
+TurtleInterpreter::TurtleInterpreter(string_view sentence, float angle, float step_length, float radius, float length_decay, float radius_decay, const PruningCriteria& pruning)
+    : sentence_(sentence),
+      rotations_(make_rotation_table(angle)),
+      turtle_(step_length, radius, length_decay, radius_decay),
+      pruning_(pruning)
+{
+    validate_sentence(sentence_);
+
+    const auto& symbols = get_symbol_table();
+    bracket_ends_.resize(sentence_.size());
+    auto open_brackets = stack<size_t>{};
+
+    for (size_t i = 0; i < sentence_.size(); i++) {
+        const auto command = symbols[(unsigned char) sentence_[i]].command;
+        if (command == Command::push) {
+            open_brackets.push(i);
+        } else if (command == Command::pop && !open_brackets.empty()) {
+            bracket_ends_[open_brackets.top()] = i;
+            open_brackets.pop();
+        }
+    }
+
+    // unmatched brackets run until the end
+    while (!open_brackets.empty()) {
+        bracket_ends_[open_brackets.top()] = sentence_.size();
+        open_brackets.pop();
+    }
+}
+
+TurtleTransform TurtleInterpreter::get_transform(char symbol) const
+{
+    const auto decoded = get_symbol_table()[(unsigned char) symbol];
+    if (decoded.command == Command::forward) {
+        return { glm::quat{ 1.0f, 0.0f, 0.0f, 0.0f }, DIRECTION, turtle_.length_decay, turtle_.radius_decay };
+    }
+    if (decoded.command == Command::rotate) {
+        return { rotations_[decoded.rotation] };
+    }
+    // brackets don't change the turtle
+    return {};
+}
+
+Branch TurtleInterpreter::run() const
+{
+    auto sentence = sentence_;
+    return do_the_turtle(sentence, turtle_);
+}
+
+Branch TurtleInterpreter::run_parallel(unsigned int threads_count) const
+{
+    if (threads_count <= 1) {
+        return run();
+    }
+
+    const auto min_subtree_size = std::max(MIN_SUBTREE_TASK_SIZE, sentence_.size() / (threads_count * TASKS_PER_THREAD));
+    auto schedule = SubtreeSchedule{};
+    schedule.tasks.push_back({ 0, turtle_ });
+    schedule_subtrees(schedule, 0, turtle_, min_subtree_size);
+
+    if (schedule.tasks.size() == 1) {
+        return run();
+    }
+
+    auto branches = vector<Branch>(schedule.tasks.size());
+    auto spawned_forks = vector<SubtreeSchedule::SpawnedForks>(schedule.tasks.size());
+    parallel_for(schedule.tasks.size(), threads_count, [&](size_t i) {
+        const auto& task = schedule.tasks[i];
+        auto sentence = sentence_.substr(task.begin);
+        branches[i] = do_the_turtle(sentence, task.turtle, &schedule, &spawned_forks[i]);
+    });
+
+    // stitch in reverse order so that children are complete when moved
+    for (size_t i = schedule.tasks.size(); i-- > 0;) {
+        for (const auto& [fork_index, task_index] : spawned_forks[i]) {
+            branches[i].forks[fork_index] = std::move(branches[task_index]);
+        }
+    }
+
+    return std::move(branches[0]);
+}
+
+// walk the turtle without drawing, skipping small subtrees using the bracket index
+void TurtleInterpreter::schedule_subtrees(SubtreeSchedule& schedule, size_t begin, Turtle turtle, size_t min_subtree_size) const
+{
+    const auto& symbols = get_symbol_table();
+
+    for (size_t i = begin; i < sentence_.size();) {
+        const auto symbol = symbols[(unsigned char) sentence_[i]];
+
+        if (symbol.command == Command::pop) {
+            return;
+        }
+
+        if (symbol.command == Command::push) {
+            const auto end = bracket_ends_[i];
+            if (end - i >= min_subtree_size && !should_prune(turtle)) {
+                schedule.task_indices[i] = schedule.tasks.size();
+                schedule.tasks.push_back({ i + 1, turtle });
+                schedule_subtrees(schedule, i + 1, turtle, min_subtree_size);
+            }
+            i = end + 1;
+            continue;
+        }
+
+        if (symbol.command == Command::forward) {
+            turtle.step_foward();
+            turtle.decay();
+        } else {
+            assert(symbol.command == Command::rotate);
+            turtle.rotate(rotations_[symbol.rotation]);
+        }
+        i++;
+    }
+}
+
+template <typename F>
+void TurtleInterpreter::walk_groups(size_t begin, Turtle turtle, unsigned int depth, F& on_group) const
+{
+    const auto& symbols = get_symbol_table();
+
+    for (size_t i = begin; i < sentence_.size();) {
+        const auto symbol = symbols[(unsigned char) sentence_[i]];
+
+        if (symbol.command == Command::pop) {
+            return;
+        }
+
+        if (symbol.command == Command::push) {
+            // group branch is a fork, one level below the branch holding it
+            if (!should_prune(turtle) && on_group(i, turtle, depth + 1)) {
+                walk_groups(i + 1, turtle, depth + 1, on_group);
+            }
+            i = bracket_ends_[i] + 1;
+            continue;
+        }
+
+        if (symbol.command == Command::forward) {
+            turtle.step_foward();
+            turtle.decay();
+        } else {
+            assert(symbol.command == Command::rotate);
+            turtle.rotate(rotations_[symbol.rotation]);
+        }
+        i++;
+    }
+}
+
+SubtreeRepeats TurtleInterpreter::find_repeated_subtrees(size_t min_subtree_size, float size_tolerance, float radius_tolerance) const
+{
+    auto repeats = SubtreeRepeats{};
+    if (pruning_.should_prune) {
+        repeats.sentence = string{ sentence_ };
+        return repeats;
+    }
+
+    // polynomial hashes of prefixes, so that any group is hashed in constant time
+    const uint64_t base = 1000003;
+    auto prefix_hashes = vector<uint64_t>(sentence_.size() + 1, 0);
+    auto powers = vector<uint64_t>(sentence_.size() + 1, 1);
+    for (size_t i = 0; i < sentence_.size(); i++) {
+        prefix_hashes[i + 1] = prefix_hashes[i] * base + (unsigned char) sentence_[i];
+        powers[i + 1] = powers[i] * base;
+    }
+
+    // forwards from each group start to its furthest opening bracket, -1 without any, by group position
+    const auto& symbols = get_symbol_table();
+    auto push_forwards = vector<int>(sentence_.size(), -1);
+    {
+        struct OpenGroup
+        {
+            size_t position;
+            int forwards;
+            int max_push_forwards;
+        };
+        auto open_groups = vector<OpenGroup>{ { sentence_.size(), 0, -1 } };
+        auto close_group = [&]() {
+            const auto group = open_groups.back();
+            open_groups.pop_back();
+            push_forwards[group.position] = group.max_push_forwards;
+            auto& parent = open_groups.back();
+            if (group.max_push_forwards >= 0) {
+                parent.max_push_forwards = std::max(parent.max_push_forwards, parent.forwards + group.max_push_forwards);
+            }
+        };
+        for (size_t i = 0; i < sentence_.size(); i++) {
+            const auto command = symbols[(unsigned char) sentence_[i]].command;
+            if (command == Command::forward) {
+                open_groups.back().forwards++;
+            } else if (command == Command::push) {
+                open_groups.back().max_push_forwards = std::max(open_groups.back().max_push_forwards, open_groups.back().forwards);
+                open_groups.push_back({ i, 0, -1 });
+            } else if (command == Command::pop) {
+                // closing bracket at root level ends the tree
+                if (open_groups.size() == 1) {
+                    break;
+                }
+                close_group();
+            }
+        }
+        while (open_groups.size() > 1) {
+            close_group();
+        }
+    }
+
+    // occurrences must all be unpruned inside, so that they are the same subtree
+    auto reaches_pruning = [&](size_t position, const Turtle& turtle) {
+        const int forwards = push_forwards[position];
+        return forwards >= 0
+            && (turtle.radius * std::pow(turtle.radius_decay, forwards) < pruning_.min_radius
+                || turtle.step_length * std::pow(turtle.length_decay, forwards) < pruning_.min_step_length);
+    };
+
+    // symbols hash, depth, quantized logs of step length and of radius over step length
+    using Key = std::tuple<uint64_t, unsigned int, long, long>;
+    const double log_step = std::log1p(std::max(size_tolerance, 1e-6f));
+    const double log_radius_step = std::log1p(std::max(radius_tolerance, 1e-6f));
+    auto get_key = [&](size_t position, const Turtle& turtle, unsigned int depth) {
+        const auto begin = position + 1;
+        const auto end = bracket_ends_[position];
+        const auto hash = prefix_hashes[end] - prefix_hashes[begin] * powers[end - begin];
+        return Key{
+            hash,
+            depth,
+            std::lround(std::log(turtle.step_length) / log_step),
+            std::lround(std::log(turtle.radius / turtle.step_length) / log_radius_step)
+        };
+    };
+    auto is_big_enough = [&](size_t position, const Turtle& turtle) {
+        return bracket_ends_[position] - position - 1 >= min_subtree_size && !reaches_pruning(position, turtle);
+    };
+
+    auto counts = std::map<Key, size_t>{};
+    auto count_group = [&](size_t position, const Turtle& turtle, unsigned int depth) {
+        if (is_big_enough(position, turtle)) {
+            counts[get_key(position, turtle, depth)]++;
+        }
+        return true;
+    };
+    walk_groups(0, turtle_, 0, count_group);
+
+    // outermost repeated groups are cut out of the sentence
+    auto subtree_indices = std::map<Key, size_t>{};
+    size_t copied_end = 0;
+    auto cut_group = [&](size_t position, const Turtle& turtle, unsigned int depth) {
+        if (!is_big_enough(position, turtle)) {
+            return true;
+        }
+        const auto key = get_key(position, turtle, depth);
+        if (counts[key] < 2) {
+            return true;
+        }
+
+        const auto end = bracket_ends_[position];
+        const auto group = sentence_.substr(position + 1, end - position - 1);
+        auto [it, is_new] = subtree_indices.try_emplace(key, repeats.subtrees.size());
+        if (is_new) {
+            repeats.subtrees.push_back({ group, depth, {} });
+        } else if (repeats.subtrees[it->second].sentence != group) {
+            // hash collision
+            return true;
+        }
+        repeats.subtrees[it->second].turtles.push_back(turtle);
+
+        repeats.sentence += sentence_.substr(copied_end, position - copied_end);
+        copied_end = std::min(end + 1, sentence_.size());
+        return false;
+    };
+    walk_groups(0, turtle_, 0, cut_group);
+    repeats.sentence += sentence_.substr(copied_end);
+
+    // groups also repeated inside bigger repeated groups may end up with a single occurrence here
+    return repeats;
+}
+
+bool TurtleInterpreter::should_prune(const Turtle& turtle) const
+{
+    if (turtle.radius < pruning_.min_radius || turtle.step_length < pruning_.min_step_length) {
+        return true;
+    }
+    return pruning_.should_prune && pruning_.should_prune(turtle.position, turtle.step_length, turtle.radius);
+}
+
+void TurtleInterpreter::skip_subtree(string_view& sentence) const
+{
+    const size_t position = sentence.data() - sentence_.data() - 1;
+    sentence.remove_prefix(std::min(bracket_ends_[position] - position, sentence.size()));
+}
+
+Branch TurtleInterpreter::do_the_turtle(string_view& sentence, Turtle turtle, const SubtreeSchedule* schedule, SubtreeSchedule::SpawnedForks* spawned_forks) const
+{
+    const auto& symbols = get_symbol_table();
+    Branch branch;
+
+    // push starting point
+    branch.points.push_back(turtle.position);
+    branch.radius_begin = turtle.radius;
+
+    while (sentence.size() > 0) {
+        const auto symbol = symbols[(unsigned char) sentence.front()];
+        sentence.remove_prefix(1);
+
+        if (symbol.command == Command::pop) {
+            break;
+        }
+
+        switch (symbol.command) {
+        case Command::forward:
+            turtle.step_foward();
+            turtle.decay();
+            break;
+        case Command::push: {
+            if (should_prune(turtle)) {
+                auto& leaf = branch.forks.emplace_back();
+                leaf.points.push_back(turtle.position);
+                leaf.radius_begin = turtle.radius;
+                leaf.radius_end = turtle.radius;
+                leaf.is_pruned = true;
+                skip_subtree(sentence);
+                break;
+            }
+
+            if (schedule != nullptr) {
+                // subtree interpreted by another task, leave room for it
+                const size_t position = sentence.data() - sentence_.data() - 1;
+                const auto it = schedule->task_indices.find(position);
+                if (it != schedule->task_indices.end()) {
+                    spawned_forks->push_back({ branch.forks.size(), it->second });
+                    branch.forks.emplace_back();
+                    skip_subtree(sentence);
+                    break;
+                }
+            }
+            // smaller subtrees never contain scheduled ones
+            branch.forks.push_back(do_the_turtle(sentence, turtle));
+            break;
+        }
+        case Command::rotate:
+            // rotation char, push current point
+            if (turtle.position != branch.points.back()) {
+                branch.points.push_back(turtle.position);
+            }
+            turtle.rotate(rotations_[symbol.rotation]);
+            break;
+        default:
+            // invalid symbols are rejected at construction
+            assert(false);
+            break;
+        }
+    }
+
+    if (turtle.position != branch.points.back()) {
+        branch.points.push_back(turtle.position);
+        branch.radius_end = turtle.radius;
+    }
+
+    return branch;
+}
+}
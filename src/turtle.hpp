@@ -0,0 +1,308 @@
+#pragma once
+#include "branch.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <glm/glm.hpp>
+#include <glm/gtc/quaternion.hpp>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace lindenmaker {
+
+const auto DIRECTION = glm::vec3{ 0.0f, 1.0f, 0.0f };
+
+enum class Command : unsigned char
+{
+    invalid,
+    forward,
+    push,
+    pop,
+    rotate
+};
+
+/** Decoded sentence symbol, rotation is an index into RotationTable */
+struct Symbol
+{
+    Command command = Command::invalid;
+    unsigned char rotation = 0;
+};
+
+using SymbolTable = std::array<Symbol, 256>;
+
+/** Rotations for + - / \ ^ _, in that order */
+using RotationTable = std::array<glm::quat, 6>;
+
+const SymbolTable& get_symbol_table();
+RotationTable make_rotation_table(float angle);
+/** Throws on unknown symbols */
+void validate_sentence(std::string_view sentence);
+
+/** Composable change of turtle state, translation is in step lengths and local to the turtle */
+struct TurtleTransform
+{
+    glm::quat rotation = glm::quat{ 1.0f, 0.0f, 0.0f, 0.0f };
+    glm::vec3 translation = glm::vec3{ 0.0f };
+    float length_scale = 1.0f;
+    float radius_scale = 1.0f;
+};
+
+/** Transform doing first then second, associative */
+inline TurtleTransform compose(const TurtleTransform& first, const TurtleTransform& second)
+{
+    return {
+        first.rotation * second.rotation,
+        first.translation + first.length_scale * (first.rotation * second.translation),
+        first.length_scale * second.length_scale,
+        first.radius_scale * second.radius_scale
+    };
+}
+
+struct Turtle
+{
+    glm::vec3 position = glm::vec3{ 0.0f };
+    glm::quat orientation = glm::quat{ 1.0f, 0.0f, 0.0f, 0.0f };
+
+    float step_length;
+    float radius;
+    float length_decay;
+    float radius_decay;
+
+    Turtle(float step_length, float radius, float length_decay, float radius_decay)
+        : step_length(step_length),
+          radius(radius),
+          length_decay(length_decay),
+          radius_decay(radius_decay)
+    {
+    }
+
+    void step_foward()
+    {
+        position += orientation * DIRECTION * step_length;
+    }
+
+    void decay()
+    {
+        step_length *= length_decay;
+        radius *= radius_decay;
+    }
+
+    void rotate(const glm::quat& rotation)
+    {
+        orientation *= rotation;
+    }
+
+    void apply(const TurtleTransform& transform)
+    {
+        position += orientation * transform.translation * step_length;
+        orientation *= transform.rotation;
+        step_length *= transform.length_scale;
+        radius *= transform.radius_scale;
+    }
+};
+
+/** Big subtrees interpreted separately by run_parallel() */
+struct SubtreeSchedule
+{
+    struct Task
+    {
+        std::size_t begin;
+        Turtle turtle;
+    };
+
+    // fork index in parent branch => task index
+    using SpawnedForks = std::vector<std::pair<std::size_t, std::size_t>>;
+
+    // task 0 is the root, children always come after their parent
+    std::vector<Task> tasks;
+    // position of opening bracket => task index
+    std::unordered_map<std::size_t, std::size_t> task_indices;
+};
+
+/** Bracket group repeated in a sentence, see TurtleInterpreter::find_repeated_subtrees() */
+struct RepeatedSubtree
+{
+    // symbols between brackets, excluded
+    std::string_view sentence;
+    // depth of the group branch in the tree, the root being 0 and its forks 1
+    unsigned int depth;
+    // turtle at the start of each occurrence
+    std::vector<Turtle> turtles;
+};
+
+struct SubtreeRepeats
+{
+    // sentence without repeated subtrees, which leaves the rest of the tree unchanged
+    std::string sentence;
+    std::vector<RepeatedSubtree> subtrees;
+};
+
+/** Interprets a sentence, which is validated once at construction */
+class TurtleInterpreter
+{
+public:
+    TurtleInterpreter(std::string_view sentence, float angle, float step_length, float radius, float length_decay, float radius_decay, const PruningCriteria& pruning = {});
+
+    std::string_view get_sentence() const { return sentence_; }
+    const Turtle& get_turtle() const { return turtle_; }
+    TurtleTransform get_transform(char symbol) const;
+
+    Branch run() const;
+    /** Same result as run(), big subtrees being interpreted concurrently */
+    Branch run_parallel(unsigned int threads_count) const;
+
+    /**
+     * Bracket groups of at least min_subtree_size symbols found several times with the same symbols,
+     * at the same depth, with step lengths equal within size_tolerance and ratios of radius to step length
+     * equal within radius_tolerance (relative). Groups where pruning may happen are left out.
+     * Occurrences are then the same subtree up to a rotation, a translation and a uniform scale,
+     * the ratio of step lengths, so that they can be meshed once. Points scale exactly, radii are off
+     * by radius_tolerance at most. Outermost groups are preferred.
+     * Nothing is found with a custom pruning function, which may depend on position.
+     */
+    SubtreeRepeats find_repeated_subtrees(std::size_t min_subtree_size, float size_tolerance, float radius_tolerance) const;
+
+    /**
+     * Walks the sentence without building a tree, calling on visitor
+     * begin_branch(turtle), add_point(turtle), add_pruned(turtle) and end_branch(turtle),
+     * points being the same as in branches built by run()
+     */
+    template <typename Visitor>
+    void visit(Visitor& visitor) const
+    {
+        auto sentence = sentence_;
+        visit_branch(sentence, turtle_, visitor);
+    }
+
+    /**
+     * Calls on_symbol(position, is_pruned) on each symbol visit() interprets, in order.
+     * Pruned subtrees only show their opening bracket, and the walk stops at an unmatched
+     * closing bracket. Cheaper than visit(), turtles only moving with a custom pruning function.
+     */
+    template <typename F>
+    void visit_symbols(F& on_symbol) const;
+
+private:
+    std::string_view sentence_;
+    RotationTable rotations_;
+    Turtle turtle_;
+    PruningCriteria pruning_;
+    // position of opening bracket => position of matching closing bracket
+    // (or sentence size if unmatched), undefined for other symbols
+    std::vector<std::size_t> bracket_ends_;
+
+    bool should_prune(const Turtle& turtle) const;
+    // sentence must start right after an opening bracket
+    void skip_subtree(std::string_view& sentence) const;
+    Branch do_the_turtle(std::string_view& sentence, Turtle turtle, const SubtreeSchedule* schedule = nullptr, SubtreeSchedule::SpawnedForks* spawned_forks = nullptr) const;
+    void schedule_subtrees(SubtreeSchedule& schedule, std::size_t begin, Turtle turtle, std::size_t min_subtree_size) const;
+
+    // calls on_group(position, turtle, depth) at unpruned opening brackets, depth being that of the group branch
+    // (depth of the walked branch + 1), walking the group if it returns true
+    template <typename F>
+    void walk_groups(std::size_t begin, Turtle turtle, unsigned int depth, F& on_group) const;
+
+    template <typename Visitor>
+    void visit_branch(std::string_view& sentence, Turtle turtle, Visitor& visitor) const;
+};
+
+template <typename F>
+void TurtleInterpreter::visit_symbols(F& on_symbol) const
+{
+    const auto& symbols = get_symbol_table();
+    // radii and step lengths are enough to prune, unless pruning depends on position
+    const bool should_move = static_cast<bool>(pruning_.should_prune);
+    auto turtle = turtle_;
+    auto turtles = std::vector<Turtle>{};
+
+    for (std::size_t i = 0; i < sentence_.size(); i++) {
+        const auto symbol = symbols[(unsigned char) sentence_[i]];
+
+        switch (symbol.command) {
+        case Command::forward:
+            if (should_move) {
+                turtle.step_foward();
+            }
+            turtle.decay();
+            break;
+        case Command::push:
+            if (should_prune(turtle)) {
+                on_symbol(i, true);
+                i = bracket_ends_[i];
+                continue;
+            }
+            turtles.push_back(turtle);
+            break;
+        case Command::pop:
+            // closing bracket at root level ends the tree
+            if (turtles.empty()) {
+                return;
+            }
+            turtle = turtles.back();
+            turtles.pop_back();
+            break;
+        case Command::rotate:
+            if (should_move) {
+                turtle.rotate(rotations_[symbol.rotation]);
+            }
+            break;
+        default:
+            // invalid symbols are rejected at construction
+            assert(false);
+            break;
+        }
+        on_symbol(i, false);
+    }
+}
+
+template <typename Visitor>
+void TurtleInterpreter::visit_branch(std::string_view& sentence, Turtle turtle, Visitor& visitor) const
+{
+    const auto& symbols = get_symbol_table();
+    auto last_point = turtle.position;
+    visitor.begin_branch(turtle);
+
+    while (sentence.size() > 0) {
+        const auto symbol = symbols[(unsigned char) sentence.front()];
+        sentence.remove_prefix(1);
+
+        if (symbol.command == Command::pop) {
+            break;
+        }
+
+        switch (symbol.command) {
+        case Command::forward:
+            turtle.step_foward();
+            turtle.decay();
+            break;
+        case Command::push:
+            if (should_prune(turtle)) {
+                visitor.add_pruned(turtle);
+                skip_subtree(sentence);
+                break;
+            }
+            visit_branch(sentence, turtle, visitor);
+            break;
+        case Command::rotate:
+            if (turtle.position != last_point) {
+                last_point = turtle.position;
+                visitor.add_point(turtle);
+            }
+            turtle.rotate(rotations_[symbol.rotation]);
+            break;
+        default:
+            // invalid symbols are rejected at construction
+            assert(false);
+            break;
+        }
+    }
+
+    if (turtle.position != last_point) {
+        visitor.add_point(turtle);
+    }
+    visitor.end_branch(turtle);
+}
+}
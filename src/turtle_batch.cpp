@@ -0,0 +1,153 @@
+#include "turtle_batch.hpp"
+#include "turtle.hpp"
+#include <algorithm>
+#include <cassert>
+
+namespace lindenmaker {
+
+using std::size_t;
+using std::string_view;
+using std::vector;
+
+// same operations in the same order as glm, so that each lane matches the scalar turtle
+
+static LaneVector cross(const LaneVector& a, const LaneVector& b)
+{
+    return {
+        a.y * b.z - b.y * a.z,
+        a.z * b.x - b.z * a.x,
+        a.x * b.y - b.x * a.y
+    };
+}
+
+static LaneVector rotate(const LaneQuat& q, const LaneVector& v)
+{
+    const auto quat_vector = LaneVector{ q.x, q.y, q.z };
+    const auto uv = cross(quat_vector, v);
+    const auto uuv = cross(quat_vector, uv);
+    return {
+        v.x + ((uv.x * q.w) + uuv.x) * 2.0f,
+        v.y + ((uv.y * q.w) + uuv.y) * 2.0f,
+        v.z + ((uv.z * q.w) + uuv.z) * 2.0f
+    };
+}
+
+static LaneQuat multiply(const LaneQuat& p, const LaneQuat& q)
+{
+    return {
+        p.w * q.w - p.x * q.x - p.y * q.y - p.z * q.z,
+        p.w * q.x + p.x * q.w + p.y * q.z - p.z * q.y,
+        p.w * q.y + p.y * q.w + p.z * q.x - p.x * q.z,
+        p.w * q.z + p.z * q.w + p.x * q.y - p.y * q.x
+    };
+}
+
+BatchTurtleInterpreter::BatchTurtleInterpreter(string_view sentence, const TurtleParameters* variants, size_t variants_count)
+    : sentence_(sentence), variants_count_(variants_count)
+{
+    assert(variants_count > 0 && variants_count <= LANES_COUNT);
+    validate_sentence(sentence_);
+
+    turtle_.position = { broadcast(0.0f), broadcast(0.0f), broadcast(0.0f) };
+    turtle_.orientation = { broadcast(1.0f), broadcast(0.0f), broadcast(0.0f), broadcast(0.0f) };
+
+    for (size_t lane = 0; lane < LANES_COUNT; lane++) {
+        // pad unused lanes with the last parameter set
+        const auto& variant = variants[std::min(lane, variants_count - 1)];
+
+        turtle_.step_length[lane] = variant.step_length;
+        turtle_.radius[lane] = variant.radius;
+        length_decays_[lane] = variant.length_decay;
+        radius_decays_[lane] = variant.radius_decay;
+
+        const auto rotations = make_rotation_table(variant.angle);
+        for (size_t i = 0; i < rotations.size(); i++) {
+            rotations_[i].w[lane] = rotations[i].w;
+            rotations_[i].x[lane] = rotations[i].x;
+            rotations_[i].y[lane] = rotations[i].y;
+            rotations_[i].z[lane] = rotations[i].z;
+        }
+    }
+}
+
+vector<Branch> BatchTurtleInterpreter::run() const
+{
+    auto trees = vector<Branch>(variants_count_);
+    auto branches = LaneBranches{};
+    for (size_t lane = 0; lane < variants_count_; lane++) {
+        branches[lane] = &trees[lane];
+    }
+
+    auto sentence = sentence_;
+    do_the_turtles(sentence, turtle_, branches);
+    return trees;
+}
+
+void BatchTurtleInterpreter::do_the_turtles(string_view& sentence, BatchTurtle turtle, const LaneBranches& branches) const
+{
+    const auto& symbols = get_symbol_table();
+    const auto direction = LaneVector{ broadcast(DIRECTION.x), broadcast(DIRECTION.y), broadcast(DIRECTION.z) };
+
+    // push starting point
+    auto last_points = turtle.position;
+    for (size_t lane = 0; lane < variants_count_; lane++) {
+        branches[lane]->points.push_back(get_lane(turtle.position, lane));
+        branches[lane]->radius_begin = turtle.radius[lane];
+    }
+
+    // push current point for lanes where it changed
+    auto push_changed_points = [&](bool is_end) {
+        const auto& position = turtle.position;
+        const auto changed = (position.x != last_points.x) | (position.y != last_points.y) | (position.z != last_points.z);
+        for (size_t lane = 0; lane < variants_count_; lane++) {
+            if (!changed[lane]) {
+                continue;
+            }
+            branches[lane]->points.push_back(get_lane(position, lane));
+            if (is_end) {
+                branches[lane]->radius_end = turtle.radius[lane];
+            }
+        }
+        last_points = position;
+    };
+
+    while (sentence.size() > 0) {
+        const auto symbol = symbols[(unsigned char) sentence.front()];
+        sentence.remove_prefix(1);
+
+        if (symbol.command == Command::pop) {
+            break;
+        }
+
+        switch (symbol.command) {
+        case Command::forward: {
+            const auto step = rotate(turtle.orientation, direction);
+            turtle.position.x += step.x * turtle.step_length;
+            turtle.position.y += step.y * turtle.step_length;
+            turtle.position.z += step.z * turtle.step_length;
+            turtle.step_length *= length_decays_;
+            turtle.radius *= radius_decays_;
+            break;
+        }
+        case Command::push: {
+            auto fork_branches = LaneBranches{};
+            for (size_t lane = 0; lane < variants_count_; lane++) {
+                fork_branches[lane] = &branches[lane]->forks.emplace_back();
+            }
+            do_the_turtles(sentence, turtle, fork_branches);
+            break;
+        }
+        case Command::rotate:
+            push_changed_points(false);
+            turtle.orientation = multiply(turtle.orientation, rotations_[symbol.rotation]);
+            break;
+        default:
+            // invalid symbols are rejected at construction
+            assert(false);
+            break;
+        }
+    }
+
+    push_changed_points(true);
+}
+}
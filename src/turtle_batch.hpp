@@ -0,0 +1,44 @@
+#pragma once
+#include "branch.hpp"
+#include "lanes.hpp"
+#include <array>
+#include <cstddef>
+#include <string_view>
+#include <vector>
+
+namespace lindenmaker {
+
+struct LaneQuat
+{
+    Lanes w, x, y, z;
+};
+
+/** Structure of arrays turtle, one lane per parameter set */
+struct BatchTurtle
+{
+    LaneVector position;
+    LaneQuat orientation;
+    Lanes step_length;
+    Lanes radius;
+};
+
+/** Interprets a sentence for up to LANES_COUNT parameter sets at once */
+class BatchTurtleInterpreter
+{
+public:
+    BatchTurtleInterpreter(std::string_view sentence, const TurtleParameters* variants, std::size_t variants_count);
+
+    std::vector<Branch> run() const;
+
+private:
+    std::string_view sentence_;
+    std::size_t variants_count_;
+    std::array<LaneQuat, 6> rotations_;
+    Lanes length_decays_;
+    Lanes radius_decays_;
+    BatchTurtle turtle_;
+
+    using LaneBranches = std::array<Branch*, LANES_COUNT>;
+    void do_the_turtles(std::string_view& sentence, BatchTurtle turtle, const LaneBranches& branches) const;
+};
+}